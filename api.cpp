@@ -1,93 +1,220 @@
 #include "api.hpp"
 
+#include <stdexcept>
+
 NAMESPACE_BEGIN(smartqq)
 
+static const std::string SLOT = "{##}";
+
+ApiUrl::ApiUrl(ApiId id, const std::string &url, const std::string &referer) :
+    id(id), url(url), referer(referer), literalLength(0)
+{
+    auto scheme = url.find("://");
+    if (scheme != std::string::npos) {
+        origin = url.substr(0, url.find('/', scheme + 3));
+    }
+
+    std::string::size_type begin = 0, slot;
+    while ((slot = url.find(SLOT, begin)) != std::string::npos) {
+        fragments.push_back(url.substr(begin, slot - begin));
+        begin = slot + SLOT.length();
+    }
+    fragments.push_back(url.substr(begin));
+    for (auto& i : fragments) {
+        literalLength += i.length();
+    }
+}
+
+std::string ApiUrl::buildUrl(const std::list<std::string>& paramList) const
+{
+    std::vector<ApiArg> args(paramList.begin(), paramList.end());
+    return render(args.data(), args.size());
+}
+
+std::string ApiUrl::render(const ApiArg* args, size_t count) const
+{
+    if (count != getSlotCount()) {
+        throw std::invalid_argument(std::string("Wrong number of url parameters for ")
+                .append(apiNameOf(id)));
+    }
+    size_t length = literalLength;
+    for (size_t i = 0; i < count; i ++) {
+        length += args[i].length;
+    }
+
+    std::string ret;
+    ret.reserve(length);
+    ret.append(fragments[0]);
+    for (size_t i = 0; i < count; i ++) {
+        ret.append(args[i].data(), args[i].length).append(fragments[i + 1]);
+    }
+    return ret;
+}
+
 const std::string ApiUrl::USER_AGENT = "Mozilla/5.0 (Windows NT 6.3; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/45.0.2454.101 Safari/537.36";
 
 const ApiUrl
 __GET_QR_CODE (
+    API_GET_QR_CODE,
     "https://ssl.ptlogin2.qq.com/ptqrshow?appid=501004106&e=0&l=M&s=5&d=72&v=4&t=0.1",
     "https://ui.ptlogin2.qq.com/cgi-bin/login"
 ),
 __VERIFY_QR_CODE (
+    API_VERIFY_QR_CODE,
     "https://ssl.ptlogin2.qq.com/ptqrlogin?webqq_type=10&remember_uin=1&login2qq=1&aid=501004106&u1=http%3A%2F%2Fw.qq.com%2Fproxy.html%3Flogin2qq%3D1%26webqq_type%3D10&ptredirect=0&ptlang=2052&daid=164&from_ui=1&pttype=1&dumy=&fp=loginerroralert&action=0-0-157510&mibao_css=m_webqq&t=1&g=1&js_type=0&js_ver=10143&login_sig=&pt_randsalt=0",
     "https://ui.ptlogin2.qq.com/cgi-bin/login"
 ),
 __CGI_REPORT (
+    API_CGI_REPORT,
     "http://cgi.connect.qq.com/report/report?strValue=0&nValue=11202&tag=0&qver=0.0.1&t={##}",
     "http://w.qq.com"
 ),
 __WSPEED_CGI (
+    API_WSPEED_CGI,
     "http://wspeed.qq.com/w.cgi?appid=1000164&touin=null&releaseversion=SMARTQQ&frequency=1&commandid=http%3A%2F%2Fs.web2.qq.com%2Fapi%2Fgetvfwebqq&resultcode=0&tmcost=549",
     "http://w.qq.com/"
 ),
 __GET_PTWEBQQ (
+    API_GET_PTWEBQQ,
     "{##}",
     "https://ui.ptlogin2.qq.com/cgi-bin/login"
 ),
 __GET_VFWEBQQ (
+    API_GET_VFWEBQQ,
     "http://s.web2.qq.com/api/getvfwebqq?ptwebqq={##}&clientid=53999199&psessionid=&t={##}",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 ),
 __GET_UIN_AND_PSESSIONID (
+    API_GET_UIN_AND_PSESSIONID,
     "http://d1.web2.qq.com/channel/login2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_GROUP_LIST (
+    API_GET_GROUP_LIST,
     "http://s.web2.qq.com/api/get_group_name_list_mask2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __POLL_MESSAGE (
+    API_POLL_MESSAGE,
     "http://d1.web2.qq.com/channel/poll2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __SEND_MESSAGE_TO_GROUP (
+    API_SEND_MESSAGE_TO_GROUP,
     "http://d1.web2.qq.com/channel/send_qun_msg2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_FRIEND_LIST (
+    API_GET_FRIEND_LIST,
     "http://s.web2.qq.com/api/get_user_friends2",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 ),
 __SEND_MESSAGE_TO_FRIEND (
+    API_SEND_MESSAGE_TO_FRIEND,
     "http://d1.web2.qq.com/channel/send_buddy_msg2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_DISCUSS_LIST (
+    API_GET_DISCUSS_LIST,
     "http://s.web2.qq.com/api/get_discus_list?clientid=53999199&psessionid={##}&vfwebqq={##}&t=0.1",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 ),
 __SEND_MESSAGE_TO_DISCUSS (
+    API_SEND_MESSAGE_TO_DISCUSS,
     "http://d1.web2.qq.com/channel/send_discu_msg2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_ACCOUNT_INFO (
+    API_GET_ACCOUNT_INFO,
     "http://s.web2.qq.com/api/get_self_info2?t={##}",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 ),
 __GET_RECENT_LIST (
+    API_GET_RECENT_LIST,
     "http://d1.web2.qq.com/channel/get_recent_list2",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_FRIEND_STATUS (
+    API_GET_FRIEND_STATUS,
     "http://d1.web2.qq.com/channel/get_online_buddies2?vfwebqq={##}&clientid=53999199&psessionid={##}&t=0.1",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_GROUP_INFO (
+    API_GET_GROUP_INFO,
     "http://s.web2.qq.com/api/get_group_info_ext2?gcode={##}&vfwebqq={##}&t=0.1",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 ),
 __GET_QQ_BY_ID (
+    API_GET_QQ_BY_ID,
     "http://s.web2.qq.com/api/get_friend_uin2?tuin={##}&type=1&vfwebqq={##}&t=0.1",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 ),
 __GET_DISCUSS_INFO (
+    API_GET_DISCUSS_INFO,
     "http://d1.web2.qq.com/channel/get_discu_info?did={##}&vfwebqq={##}&clientid=53999199&psessionid={##}&t=0.1",
     "http://d1.web2.qq.com/proxy.html?v=20151105001&callback=1&id=2"
 ),
 __GET_FRIEND_INFO (
+    API_GET_FRIEND_INFO,
     "http://s.web2.qq.com/api/get_friend_info2?tuin={##}&vfwebqq={##}&clientid=53999199&psessionid={##}&t=0.1",
     "http://s.web2.qq.com/proxy.html?v=20130916001&callback=1&id=1"
 );
 
+static const ApiUrl* const API_URLS[API_COUNT] = {
+    &__GET_QR_CODE,
+    &__VERIFY_QR_CODE,
+    &__CGI_REPORT,
+    &__WSPEED_CGI,
+    &__GET_PTWEBQQ,
+    &__GET_VFWEBQQ,
+    &__GET_UIN_AND_PSESSIONID,
+    &__GET_GROUP_LIST,
+    &__POLL_MESSAGE,
+    &__SEND_MESSAGE_TO_GROUP,
+    &__GET_FRIEND_LIST,
+    &__SEND_MESSAGE_TO_FRIEND,
+    &__GET_DISCUSS_LIST,
+    &__SEND_MESSAGE_TO_DISCUSS,
+    &__GET_ACCOUNT_INFO,
+    &__GET_RECENT_LIST,
+    &__GET_FRIEND_STATUS,
+    &__GET_GROUP_INFO,
+    &__GET_QQ_BY_ID,
+    &__GET_DISCUSS_INFO,
+    &__GET_FRIEND_INFO,
+};
+
+const ApiUrl& apiUrlOf(ApiId id)
+{
+    return *API_URLS[id];
+}
+
+const char* apiNameOf(ApiId id)
+{
+    static const char* const NAMES[API_COUNT] = {
+        "ptqrshow",
+        "ptqrlogin",
+        "report",
+        "w.cgi",
+        "check_sig",
+        "getvfwebqq",
+        "login2",
+        "get_group_name_list_mask2",
+        "poll2",
+        "send_qun_msg2",
+        "get_user_friends2",
+        "send_buddy_msg2",
+        "get_discus_list",
+        "send_discu_msg2",
+        "get_self_info2",
+        "get_recent_list2",
+        "get_online_buddies2",
+        "get_group_info_ext2",
+        "get_friend_uin2",
+        "get_discu_info",
+        "get_friend_info2"
+    };
+    return NAMES[id];
+}
+
 NAMESPACE_END(smartqq)
@@ -0,0 +1,108 @@
+#include "arena.hpp"
+
+#include <cstring>
+
+using namespace smartqq;
+
+MessageArena::MessageArena(size_t blockSize) : blockSize_(blockSize), current_(0),
+    offset_(0), refs_(0), pool_(nullptr)
+{
+}
+
+void* MessageArena::Allocate(size_t size, size_t align)
+{
+    while (current_ < blocks_.size()) {
+        Block& block = blocks_[current_];
+        size_t start = (offset_ + align - 1) & ~(align - 1);
+        if (start + size <= block.size) {
+            offset_ = start + size;
+            return block.data.get() + start;
+        }
+        current_ ++;
+        offset_ = 0;
+    }
+    // Blocks come from new[], so offset 0 is aligned for anything
+    Block block;
+    block.size = size > blockSize_ ? size : blockSize_;
+    block.data.reset(new char[block.size]);
+    blocks_.push_back(std::move(block));
+    current_ = blocks_.size() - 1;
+    offset_ = size;
+    return blocks_.back().data.get();
+}
+
+char* MessageArena::CopyString(const char* data, size_t length)
+{
+    char* copy = (char*)Allocate(length, 1);
+    if (length > 0) {
+        std::memcpy(copy, data, length);
+    }
+    return copy;
+}
+
+void MessageArena::Reset()
+{
+    current_ = 0;
+    offset_ = 0;
+}
+
+size_t MessageArena::GetCapacity() const
+{
+    size_t capacity = 0;
+    for (auto& block : blocks_) {
+        capacity += block.size;
+    }
+    return capacity;
+}
+
+MessageArenaRef::MessageArenaRef(MessageArena* arena) : arena_(arena)
+{
+    arena_->refs_.fetch_add(1, std::memory_order_relaxed);
+}
+
+MessageArenaRef::MessageArenaRef(const MessageArenaRef& other) : arena_(other.arena_)
+{
+    if (arena_ != nullptr) {
+        arena_->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+MessageArenaRef::~MessageArenaRef()
+{
+    // acq_rel so the last owner sees every other owner's reads as done
+    if (arena_ != nullptr && arena_->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        arena_->pool_->Recycle(arena_);
+    }
+}
+
+MessageArenaPool::MessageArenaPool(size_t blockSize) : blockSize_(blockSize)
+{
+}
+
+MessageArenaRef MessageArenaPool::Acquire()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+        arenas_.emplace_back(new MessageArena(blockSize_));
+        arenas_.back()->pool_ = this;
+        // Every arena fits in free_ without it growing later
+        free_.reserve(arenas_.size());
+        return MessageArenaRef(arenas_.back().get());
+    }
+    MessageArena* arena = free_.back();
+    free_.pop_back();
+    return MessageArenaRef(arena);
+}
+
+void MessageArenaPool::Recycle(MessageArena* arena)
+{
+    arena->Reset();
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(arena);
+}
+
+size_t MessageArenaPool::GetCreated() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return arenas_.size();
+}
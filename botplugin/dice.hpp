@@ -6,7 +6,6 @@
 #include <iostream>
 #include <string>
 #include <cstdlib>
-#include <thread>
 #include <regex>
 
 NAMESPACE_BEGIN(smartqq)
@@ -17,23 +16,27 @@ public:
 
     void onMessage(const Message& message) {
         static const std::regex pattern("(!Dice\\s)([0-9]+)");
-        std::smatch match;
-        if(std::regex_search(message.content, match, pattern)) {
+        std::cmatch match;
+        // The command is in one of the text segments, faces don't matter
+        for (size_t i = 0; i < message.content.size(); i ++) {
+            auto segment = message.content[i];
+            if (segment.kind != MessageContent::TEXT) continue;
+            if (!std::regex_search(segment.data, segment.data + segment.length, match, pattern)) continue;
             int dice_max = std::atoi(match[2].str().data());
 
             if(dice_max != 0) {
-                GetClient().sendMessageToFriend(
+                GetClient().queueMessageToFriend(
                         message.uid,
                         std::string("Automatic reply: Dice result's "
-                            ).append(to_string(std::rand() % dice_max))
-                        );
+                            ).append(to_string(std::rand() % dice_max)),
+                        nullptr, SEND_INTERACTIVE);
             } else {
-                GetClient().sendMessageToFriend(
+                GetClient().queueMessageToFriend(
                         message.uid,
-                        std::string("Automatic reply: Can not do dice with upper limit equals to 0")
-                        );
+                        std::string("Automatic reply: Can not do dice with upper limit equals to 0"),
+                        nullptr, SEND_INTERACTIVE);
             }
-            std::this_thread::sleep_for(std::chrono::seconds(1));
+            break;
         }
     }
 
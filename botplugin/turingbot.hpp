@@ -9,7 +9,6 @@
 #include <iostream>
 #include <string>
 #include <cstdlib>
-#include <thread>
 #include <vector>
 #include <map>
 #include <regex>
@@ -164,7 +163,7 @@ public:
 
     void onMessage(const Message& message) {
         std::smatch match;
-        if(std::regex_search(message.content, match, pattern)) {
+        if(std::regex_search(message.content.str(), match, pattern)) {
             // check id map
             if(idmap_.find(message.uid) == idmap_.end()) {
                 idmap_.insert({message.uid, TuringRobotClient::GenerateId()});
@@ -174,9 +173,8 @@ public:
             try {
                 auto reply = client.Ask(msg, idmap_.at(message.uid));
 
-                GetClient().sendMessageToFriend(message.uid, reply.insert(0, "Bot reply: "));
-
-                std::this_thread::sleep_for(std::chrono::seconds(2));
+                GetClient().queueMessageToFriend(message.uid, reply.insert(0, "Bot reply: "),
+                        nullptr, SEND_INTERACTIVE);
             } catch (TuringException e) {
                 std::cerr << e.what() << endl;
             }
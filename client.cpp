@@ -1,14 +1,18 @@
 #include "client.hpp"
+#include "jsonstream.hpp"
 
 #include <iostream>
 #include <thread>
 #include <fstream>
 #include <cstdio>
 #include <ctime>
+#include <set>
 #include <stdexcept>
+#include <exception>
 using namespace smartqq;
 
-int64_t SmartQQClient::MESSAGE_ID = 32690001L;
+std::atomic<int64_t> SmartQQClient::MESSAGE_ID(32690001L);
+thread_local SmartQQClient* SmartQQClient::dispatching = nullptr;
 const int64_t SmartQQClient::Client_ID = 53999199L;
 
 #ifdef SMARTQQ_DEBUG
@@ -27,6 +31,42 @@ const int64_t SmartQQClient::Client_ID = 53999199L;
 
 using json = nlohmann::json;
 
+static uint64_t microsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Feeds the body into a JsonResultHandler as it arrives, so only the result
+ * is ever materialized */
+class JsonResultSink : public HttpBodySink {
+public:
+    JsonResultSink() : parser(handler), failed(false), parseMicros(0) {}
+
+    void Write(const char* data, size_t length) {
+        if (failed) return;
+        auto start = std::chrono::steady_clock::now();
+        try {
+            parser.Feed(data, length);
+        } catch (const std::invalid_argument& e) {
+            failed = true;
+            error = e.what();
+        }
+        parseMicros += microsSince(start);
+    }
+
+    JsonResultHandler handler;
+    JsonStreamParser parser;
+    bool failed;
+    string error;
+    // Time spent in the parser, summed over the chunks
+    uint64_t parseMicros;
+};
+
+NAMESPACE_END(smartqq)
+
 /*@TESTED
  * login()
  * getQRCode()
@@ -54,36 +94,290 @@ using json = nlohmann::json;
  * getFriendStatus()
  */
 
-SmartQQClient::SmartQQClient() {}
+SmartQQClient::SmartQQClient() : stats(new EndpointStats[API_COUNT]),
+    cookies(std::make_shared<CookieStore>()),
+    engine({
+        HttpLane("login", 2, cookies),
+        HttpLane("poll", 2, cookies),
+        HttpLane("send", 4, cookies),
+        HttpLane("directory", 4, cookies)}),
+    pollState(POLL_STOPPED), sessionLost(false), pollDepth(1), recentMessages(RECENT_MESSAGES),
+    pollBatch(PollDecoder::BATCH_MESSAGES),
+    messages(new MessageQueue(MESSAGE_QUEUE_CAPACITY, MessageQueue::BLOCK)),
+    sendPayload(std::make_shared<SendPayload>()),
+    streamingDecode(true), lastPrewarm(INT64_MIN / 2),
+    outbound([this](const OutboundMessage& message, SendCallback done) {
+                sendQueued(message, std::move(done));
+            })
+{
+    for (int id = 0; id < API_COUNT; id ++) {
+        const ApiUrl& url = apiUrlOf((ApiId)id);
+        vector<string> lines = {
+            string("User-Agent: ").append(ApiUrl::USER_AGENT),
+            string("Referer: ").append(url.getReferer()),
+            "Connection: keep-alive"
+        };
+        getHeaders[id] = std::make_shared<const HttpHeaders>(lines);
+
+        lines.push_back(string("Origin: ").append(url.getOrigin()));
+        lines.push_back("Content-Type: application/x-www-form-urlencoded");
+        lines.push_back("Accept: */*");
+        postHeaders[id] = std::make_shared<const HttpHeaders>(lines);
+    }
+}
+
+SmartQQClient::~SmartQQClient()
+{
+    // Neither thread can join itself, and left running it would go on with
+    // freed members. Better to stop right here than crash somewhere later.
+    if (dispatching == this
+            || (poller.joinable() && poller.get_id() == std::this_thread::get_id())) {
+        log_err("SmartQQClient destroyed from its own poll or dispatch thread.");
+        std::terminate();
+    }
+    close();
+}
 
 void SmartQQClient::startPolling(MessageCallback& callback)
 {
-    std::thread poll(&SmartQQClient::pollThread, this, std::ref(callback));
-    poll.detach();
+    int stopped = POLL_STOPPED;
+    if (!pollState.compare_exchange_strong(stopped, POLL_RUNNING)) {
+        return;
+    }
+    // A thread that closed itself from a callback has exited or is about to
+    if (poller.joinable()) {
+        poller.join();
+    }
+    pollCancel = std::make_shared<std::atomic<bool>>(false);
+    messages->Reset();
+    poller = std::thread(&SmartQQClient::pollThread, this, std::ref(callback));
+}
+
+void SmartQQClient::close()
+{
+    int running = POLL_RUNNING;
+    pollState.compare_exchange_strong(running, POLL_CLOSING);
+    {
+        // Taken so the notify can't slip in between the predicate and the wait
+        std::lock_guard<std::mutex> lock(pollMutex);
+    }
+    pollWakeup.notify_all();
+    // Unblocks a full queue, stops dispatch after the running callback
+    messages->Close();
+    if (pollCancel) {
+        engine.Cancel(pollCancel);
+        if (replayer) {
+            replayer->Cancel(pollCancel);
+        }
+    }
+    // From a callback the poll thread would wait on us
+    if (poller.joinable() && poller.get_id() != std::this_thread::get_id()
+            && dispatching != this) {
+        poller.join();
+    }
+}
+
+void SmartQQClient::setMessageQueue(size_t capacity, MessageQueue::Overflow overflow,
+        unsigned droppable)
+{
+    if (pollState.load() != POLL_STOPPED) {
+        throw std::logic_error("Message queue set while polling.");
+    }
+    messages.reset(new MessageQueue(capacity, overflow, droppable));
+}
+
+const MessageQueue& SmartQQClient::getMessageQueue() const
+{
+    return *messages;
+}
+
+void SmartQQClient::setDoublePolling(bool enable)
+{
+    pollDepth = enable ? 2 : 1;
+}
+
+void SmartQQClient::setBaseUrl(const string& baseUrl)
+{
+    this->baseUrl = baseUrl;
+    // Drop a trailing slash, api paths bring their own
+    if (!this->baseUrl.empty() && this->baseUrl.back() == '/') {
+        this->baseUrl.pop_back();
+    }
+}
+
+void SmartQQClient::recordTraffic(const string& path)
+{
+    recorder.reset(new TrafficRecorder(path));
+}
+
+void SmartQQClient::replayTraffic(const string& path, TrafficReplayer::Speed speed)
+{
+    replayer.reset(new TrafficReplayer(path, speed));
+}
+
+void SmartQQClient::setStreamingDecode(bool enable)
+{
+    streamingDecode = enable;
+}
+
+const EndpointStats& SmartQQClient::getStats(ApiId id) const
+{
+    return stats[id];
+}
+
+void SmartQQClient::dumpStats(std::ostream& out) const
+{
+    for (int id = 0; id < API_COUNT; id ++) {
+        if (stats[id].latency.Count() == 0) continue;
+        out << apiNameOf((ApiId)id) << ": ";
+        stats[id].Dump(out);
+        out << std::endl;
+    }
+    if (messages->GetPushed() != 0) {
+        out << "message queue: ";
+        messages->Dump(out);
+        out << std::endl;
+    }
+    if (outbound.GetSent() != 0 || outbound.GetDropped() != 0) {
+        out << "send scheduler: ";
+        outbound.Dump(out);
+        out << std::endl;
+    }
+}
+
+bool SmartQQClient::isSessionLost() const
+{
+    return sessionLost.load();
 }
 
 void SmartQQClient::pollThread(MessageCallback& callback)
 {
-    mutex.lock();
-    pollStarted = true;
-    mutex.unlock();
     log("Poll thread start.");
-    while(true) {
-        mutex.lock();
-        if (!pollStarted) {
-            mutex.unlock();
-            return;
+    // Plugins run there, so a slow one never holds up the next poll
+    std::thread dispatcher(&SmartQQClient::dispatchThread, this, std::ref(callback));
+    vector<MessageEvent> batch;
+    vector<uint64_t> keys;
+    keys.reserve(PollDecoder::BATCH_MESSAGES);
+    int64_t backoff = 0;
+    size_t outstanding = 0;
+    auto nextPoll = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(pollMutex);
+    while (pollState.load() == POLL_RUNNING) {
+        auto now = std::chrono::steady_clock::now();
+        if (outstanding < pollDepth && now >= nextPoll) {
+            outstanding ++;
+            lock.unlock();
+            submitPoll();
+            lock.lock();
+            // Stagger the polls so they don't time out at the server together
+            nextPoll = now + std::chrono::milliseconds(POLL_STAGGER);
+            continue;
+        }
+        if (pollResponses.empty()) {
+            if (outstanding < pollDepth) {
+                pollWakeup.wait_until(lock, nextPoll);
+            } else {
+                pollWakeup.wait(lock);
+            }
+            continue;
+        }
+
+        cpr::Response r = std::move(pollResponses.front());
+        pollResponses.pop_front();
+        outstanding --;
+        lock.unlock();
+        // Keep a poll waiting at the server while this one is handled
+        if (backoff == 0 && outstanding < pollDepth && pollState.load() == POLL_RUNNING) {
+            outstanding ++;
+            submitPoll();
+        }
+        try {
+            batch.clear();
+            keys.clear();
+            handlePoll(r, batch, keys);
+            for (size_t i = 0; i < batch.size(); i ++) {
+                messages->Push(std::move(batch[i]), i + 1 < batch.size());
+            }
+            // Only now, a poll that failed above is delivered again and
+            // must not be taken for a copy then
+            for (uint64_t key : keys) {
+                recentMessages.CheckAndInsert(key);
+            }
+            backoff = 0;
+        } catch (const std::runtime_error& e) {
+            log_debug(e.what());
+            // Until a new login, or the server takes the session back
+            backoff = sessionLost.load() ? POLL_BACKOFF_MAX : backoff == 0 ?
+                POLL_BACKOFF_MIN : std::min(backoff * 2, POLL_BACKOFF_MAX);
+        } catch (const std::invalid_argument& e) {
+            log_debug(e.what());
+            backoff = backoff == 0 ? POLL_BACKOFF_MIN : std::min(backoff * 2, POLL_BACKOFF_MAX);
+        }
+        lock.lock();
+        nextPoll = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoff);
+    }
+
+    // close() cancelled the polls still out, their callbacks come back soon
+    // and must not find the client gone
+    while (outstanding > 0) {
+        pollWakeup.wait(lock, [this] { return !pollResponses.empty(); });
+        pollResponses.pop_front();
+        outstanding --;
+    }
+    lock.unlock();
+    messages->Close();
+    dispatcher.join();
+    pollState.store(POLL_STOPPED);
+    log("Poll thread stop.");
+}
+
+void SmartQQClient::dispatchThread(MessageCallback& callback)
+{
+    dispatching = this;
+    // Whatever is queued goes to the callback as one batch, usually a poll
+    vector<MessageEvent> batch;
+    MessageEvent event;
+    while (messages->Pop(event)) {
+        batch.clear();
+        batch.push_back(std::move(event));
+        while (messages->TryPop(event)) {
+            batch.push_back(std::move(event));
         }
         try {
-            pollMessage(callback);
-        } catch (std::runtime_error e) {
+            callback.onMessages(batch.data(), batch.size());
+        } catch (const std::runtime_error& e) {
             log_debug(e.what());
         } catch (const std::invalid_argument& e) {
             log_debug(e.what());
         }
-        mutex.unlock();
-        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        // Gives the arenas back before waiting for more
+        batch.clear();
     }
+    dispatching = nullptr;
+}
+
+json SmartQQClient::pollParams() const
+{
+    json j;
+    j["ptwebqq"] = ptwebqq;
+    j["clientid"] = Client_ID;
+    j["psessionid"] = psessionid;
+    j["key"] = "";
+    return j;
+}
+
+void SmartQQClient::submitPoll()
+{
+    log_debug("Polling message.");
+    const ApiUrl& url = SMARTQQ_API_URL(POLL_MESSAGE);
+    submit(url, makePost(url, pollParams()), [this](cpr::Response r) {
+        {
+            std::lock_guard<std::mutex> lock(pollMutex);
+            pollResponses.push_back(std::move(r));
+        }
+        pollWakeup.notify_all();
+    });
 }
 
 void SmartQQClient::login()
@@ -102,13 +396,16 @@ void SmartQQClient::login()
 void SmartQQClient::getQRCode()
 {
     log("Getting QRCode.");
+    // A new QR code starts a new session
+    cookies->Clear();
     auto r = get(SMARTQQ_API_URL(GET_QR_CODE));
     log_debug(r.cookies.GetEncoded());
-    cookies = r.cookies;
-    log_debug(cookies["qrsig"]);
+    log_debug(cookies->Get("qrsig"));
     fstream out("QR.png", ios::out);
     out << r.text;
     out.close();
+    // Warm the next hosts up while the user scans
+    prewarm();
     // execute a shell command with popen
     popen("fish -c \"open QR.png\"", "r");
     cout << "QR Code is in file QR.png. Please open and scan.\n";
@@ -128,7 +425,8 @@ string SmartQQClient::verifyQRCode()
         if (result.find("成功") != string::npos) {
             log_debug(r.cookies.GetEncoded());
             log_debug(r.text);
-            cookies.AddCookie(r.cookies);
+            // The connections opened during the scan may have idled out
+            prewarm();
             /*
              *cookies.DelCookie("0");
              *cookies.DelCookie("qrsig");
@@ -154,23 +452,19 @@ void SmartQQClient::getPtwebqq(const string& url)
 {
     log("Getting ptwebqq.");
 
-    list<string> params;
-    params.push_back(url);
-    auto r = get(SMARTQQ_API_URL(GET_PTWEBQQ), params);
-    cookies.AddCookie(r.cookies);
+    auto r = get(SMARTQQ_API_URL(GET_PTWEBQQ), url);
 
     log_debug(r.status_code);
     log_debug(r.cookies.GetEncoded());
     /* Get ptwebqq from cookies */
-    ptwebqq = cookies["ptwebqq"];
+    ptwebqq = cookies->Get("ptwebqq");
 }
 
 void SmartQQClient::cgiReport()
 {
     log("Reporting to cgi.");
-    list<string> params;
-    params.push_back(std::to_string((int64_t)time(nullptr)).append("821"));
-    auto r = get(SMARTQQ_API_URL(CGI_REPORT), params);
+    auto r = get(SMARTQQ_API_URL(CGI_REPORT),
+            std::to_string((int64_t)time(nullptr)).append("821"));
 
     log_debug(r.status_code);
 }
@@ -179,15 +473,12 @@ void SmartQQClient::getVfwebqq()
 {
     log("Getting vfwebqq.");
 
-    list<string> params;
-    params.push_back(ptwebqq);
-    params.push_back(std::to_string((int64_t)std::time(nullptr)).append("172"));
-    auto r = get(SMARTQQ_API_URL(GET_VFWEBQQ), params);
-    cookies.AddCookie(r.cookies);
+    auto r = get(SMARTQQ_API_URL(GET_VFWEBQQ), ptwebqq,
+            std::to_string((int64_t)std::time(nullptr)).append("172"));
     log_debug(r.status_code);
 
     /* Get vfwebqq */
-    vfwebqq = getJsonObjectResult(r)["vfwebqq"];
+    vfwebqq = getJsonObjectResult(SMARTQQ_API_URL(GET_VFWEBQQ), r)["vfwebqq"];
     log_debug(vfwebqq);
 }
 
@@ -211,9 +502,19 @@ void SmartQQClient::getUinAndPsessionid()
     p["status"] = "online";
 
     auto r = post(SMARTQQ_API_URL(GET_UIN_AND_PSESSIONID), p);
-    auto jres = getJsonObjectResult(r);
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_UIN_AND_PSESSIONID), r);
     psessionid = jres["psessionid"];
     uin = jres["uin"].get<int64_t>();
+    {
+        // A poll thread backing off from a lost session polls again at once
+        std::lock_guard<std::mutex> lock(pollMutex);
+        sessionLost.store(false);
+    }
+    pollWakeup.notify_all();
+    // Sends in flight keep the payload they started with
+    auto payload = std::make_shared<SendPayload>();
+    payload->SetSession(Client_ID, psessionid, FontRef().toString());
+    std::atomic_store(&sendPayload, std::shared_ptr<const SendPayload>(payload));
 }
 
 list<Group> SmartQQClient::getGroupList()
@@ -227,7 +528,7 @@ list<Group> SmartQQClient::getGroupList()
     j["hash"] = hash();
 
     auto r = post(SMARTQQ_API_URL(GET_GROUP_LIST), j);
-    auto jres = getJsonObjectResult(r);
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_GROUP_LIST), r);
 
     /*@Parse JSON result into list
      * */
@@ -243,81 +544,248 @@ void SmartQQClient::pollMessage(MessageCallback &callback)
 {
     log_debug("Polling message.");
 
-    json j;
-    j["ptwebqq"] = ptwebqq;
-    j["clientid"] = Client_ID;
-    j["psessionid"] = psessionid;
-    j["key"] = "";
+    vector<MessageEvent> events;
+    vector<uint64_t> keys;
+    handlePoll(post(SMARTQQ_API_URL(POLL_MESSAGE), pollParams()), events, keys);
+    for (uint64_t key : keys) {
+        recentMessages.CheckAndInsert(key);
+    }
+    if (!events.empty()) {
+        callback.onMessages(events.data(), events.size());
+    }
+}
 
-    auto r = post(SMARTQQ_API_URL(POLL_MESSAGE), j);
-    auto jres = getJsonObjectResult(r);
+static uint64_t numberOf(const json& value, const char* field)
+{
+    auto it = value.find(field);
+    return it != value.end() && it->is_number() ? it->get<uint64_t>() : 0;
+}
+
+bool SmartQQClient::isRecentMessage(MessageEvent::Type type, const json& value,
+        vector<uint64_t>& keys)
+{
+    // Without msg_id there is nothing to tell copies apart by
+    auto id = value.find("msg_id");
+    if (id == value.end() || !id->is_number()) {
+        return false;
+    }
+    uint64_t key = RecentIds::MessageKey(type, numberOf(value, "from_uin"),
+            id->get<uint64_t>(), numberOf(value, "msg_id2"), numberOf(value, "time"));
+    if (recentMessages.Contains(key) || pollBatch.CheckAndInsert(key)) {
+        return true;
+    }
+    keys.push_back(key);
+    return false;
+}
+
+void SmartQQClient::handlePoll(const cpr::Response& r, vector<MessageEvent>& events,
+        vector<uint64_t>& keys)
+{
+    const ApiUrl& url = SMARTQQ_API_URL(POLL_MESSAGE);
+    if (streamingDecode) {
+        EndpointStats& s = stats[url.getId()];
+        if (r.status_code != 200) {
+            throw std::runtime_error(string("Request failed. Http return code's ").append(to_string(r.status_code)));
+        }
+        auto start = std::chrono::steady_clock::now();
+        try {
+            // Recycled once every message of the poll is dispatched
+            pollDecoder.Decode(r.text.data(), r.text.length(), events, &recentMessages,
+                    arenas.Acquire());
+        } catch (...) {
+            s.RecordInvalid();
+            throw;
+        }
+        s.RecordParse(microsSince(start));
+        if (!pollDecoder.HasRetcode()) {
+            s.RecordInvalid();
+            throw runtime_error("Receive an invalid response. ERR:NO RETCODE");
+        }
+        handleRetcode(url, pollDecoder.GetRetcode());
+        checkSession();
+        keys.assign(pollDecoder.GetKeys().begin(), pollDecoder.GetKeys().end());
+        return;
+    }
+
+    auto jres = getResponseJson(url, r);
+    checkSession();
+    pollBatch.Reset();
+    // A long poll that timed out has no result, it isn't an error
+    auto result = jres.find("result");
+    if (result == jres.end() || !result->is_array()) {
+        return;
+    }
     /*@Parse JSON result into list
      * */
-    auto array = jres.get<vector<json>>();
-    for (auto message : array) {
-        auto type = message["poll_type"].get<string>();
-        if("message" == type) {
-            callback.onMessage(Message(message["value"]));
-        } else if("group_message" == type) {
-            callback.onGroupMessage(GroupMessage(message["value"]));
-        } else if("discu_message" == type) {
-            callback.onDiscussMessage(DiscussMessage(message["value"]));
+    for (const json& message : *result) {
+        auto type = message.find("poll_type");
+        auto value = message.find("value");
+        if (type == message.end() || !type->is_string() || value == message.end()) {
+            continue;
+        }
+        const string& pollType = type->get_ref<const string&>();
+        MessageEvent event;
+        if("message" == pollType) {
+            event.type = MessageEvent::FRIEND_MESSAGE;
+        } else if("group_message" == pollType) {
+            event.type = MessageEvent::GROUP_MESSAGE;
+        } else if("discu_message" == pollType) {
+            event.type = MessageEvent::DISCUSS_MESSAGE;
+        } else {
+            continue;
+        }
+        // Redelivered after a timeout or reconnect, or by both double polls.
+        // Checked before decoding, so copies cost nothing more.
+        if (isRecentMessage(event.type, *value, keys)) {
+            continue;
+        }
+        switch (event.type) {
+        case MessageEvent::FRIEND_MESSAGE:
+            event.message = Message(*value);
+            break;
+        case MessageEvent::GROUP_MESSAGE:
+            event.groupMessage = GroupMessage(*value);
+            break;
+        default:
+            event.discussMessage = DiscussMessage(*value);
+            break;
         }
+        events.push_back(std::move(event));
     }
 }
 
 void SmartQQClient::sendMessageToGroup(int64_t groupId, const string &msg)
 {
-    log(string("Sending message to group ").append(to_string(groupId))
-            .append("."));
-    log(msg);
+    sendMessageToGroupAsync(groupId, msg).get();
+}
 
-    json j;
-    j["group_uin"] = groupId;
-    j["content"] = json({msg, {"font", Font::DEFAULT_FONT.toString()}}).dump();
-    j["face"] = 573;
-    j["clientid"] = Client_ID;
-    j["msg_id"]  = MESSAGE_ID ++;
-    j["psessionid"] = psessionid;
+void SmartQQClient::sendMessageToDiscuss(int discussId, const string& msg)
+{
+    sendMessageToDiscussAsync(discussId, msg).get();
+}
 
-    auto r = post(SMARTQQ_API_URL(SEND_MESSAGE_TO_GROUP), j);
-    checkSendMsgResult(r);
+void SmartQQClient::sendMessageToFriend(int64_t friendId, const string& msg)
+{
+    sendMessageToFriendAsync(friendId, msg).get();
 }
 
-void SmartQQClient::sendMessageToDiscuss(int discussId, const string& msg)
+std::future<int> SmartQQClient::sendMessageToGroupAsync(int64_t groupId, const string& msg)
 {
-    log(string("Sending message to discuss ").append(to_string(discussId))
-            .append("."));
-    log(msg);
+    return sendMessageAsync(SMARTQQ_API_URL(SEND_MESSAGE_TO_GROUP), SendPayload::GROUP,
+            groupId, msg);
+}
 
-    json j;
-    j["did"] = discussId;
-    j["content"] = json({msg, {"font", Font::DEFAULT_FONT.toString()}}).dump();
-    j["face"] = 573;
-    j["clientid"] = Client_ID;
-    j["msg_id"]  = MESSAGE_ID ++;
-    j["psessionid"] = psessionid;
+std::future<int> SmartQQClient::sendMessageToDiscussAsync(int64_t discussId, const string& msg)
+{
+    return sendMessageAsync(SMARTQQ_API_URL(SEND_MESSAGE_TO_DISCUSS), SendPayload::DISCUSS,
+            discussId, msg);
+}
 
-    auto r = post(SMARTQQ_API_URL(SEND_MESSAGE_TO_DISCUSS), j);
-    checkSendMsgResult(r);
+std::future<int> SmartQQClient::sendMessageToFriendAsync(int64_t friendId, const string& msg)
+{
+    return sendMessageAsync(SMARTQQ_API_URL(SEND_MESSAGE_TO_FRIEND), SendPayload::FRIEND,
+            friendId, msg);
 }
 
-void SmartQQClient::sendMessageToFriend(int64_t friendId, const string& msg)
+bool SmartQQClient::queueMessageToGroup(int64_t groupId, const string& msg,
+        SendCallback done, SendPriority priority)
 {
-    log(string("Sending message to friend ").append(to_string(friendId))
-            .append("."));
-    log(msg);
+    return outbound.Enqueue(SendPayload::GROUP, groupId, msg, std::move(done), priority);
+}
 
-    json j;
-    j["to"] = friendId;
-    j["content"] = json({msg, {"font", Font::DEFAULT_FONT.toString()}}).dump();
-    j["face"] = 573;
-    j["clientid"] = Client_ID;
-    j["msg_id"] = MESSAGE_ID ++;
-    j["psessionid"] = psessionid;
+bool SmartQQClient::queueMessageToDiscuss(int64_t discussId, const string& msg,
+        SendCallback done, SendPriority priority)
+{
+    return outbound.Enqueue(SendPayload::DISCUSS, discussId, msg, std::move(done), priority);
+}
+
+bool SmartQQClient::queueMessageToFriend(int64_t friendId, const string& msg,
+        SendCallback done, SendPriority priority)
+{
+    return outbound.Enqueue(SendPayload::FRIEND, friendId, msg, std::move(done), priority);
+}
 
-    auto r = post(SMARTQQ_API_URL(SEND_MESSAGE_TO_FRIEND), j);
-    checkSendMsgResult(r);
+void SmartQQClient::setSendLimits(const SendLimits& limits)
+{
+    outbound.SetLimits(limits);
+}
+
+void SmartQQClient::setSendCoalescing(const SendCoalescing& coalescing)
+{
+    outbound.SetCoalescing(coalescing);
+}
+
+void SmartQQClient::setSendPriorities(const SendPriorities& priorities)
+{
+    outbound.SetPriorities(priorities);
+}
+
+const SendScheduler& SmartQQClient::getSendScheduler() const
+{
+    return outbound;
+}
+
+void SmartQQClient::sendQueued(const OutboundMessage& message, SendCallback done)
+{
+    try {
+        switch (message.target) {
+        case SendPayload::GROUP:
+            sendMessageAsync(SMARTQQ_API_URL(SEND_MESSAGE_TO_GROUP), message.target,
+                    message.id, message.text, done);
+            break;
+        case SendPayload::DISCUSS:
+            sendMessageAsync(SMARTQQ_API_URL(SEND_MESSAGE_TO_DISCUSS), message.target,
+                    message.id, message.text, done);
+            break;
+        default:
+            sendMessageAsync(SMARTQQ_API_URL(SEND_MESSAGE_TO_FRIEND), message.target,
+                    message.id, message.text, done);
+        }
+    } catch (const std::exception& e) {
+        // Not submitted, so done was not called
+        log_err(string("Send failed. ").append(e.what()));
+        done(SEND_FAILED);
+    }
+}
+
+std::future<int> SmartQQClient::sendMessageAsync(const ApiUrl& url, SendPayload::Target target,
+        int64_t id, const string& msg)
+{
+    auto promise = std::make_shared<std::promise<int>>();
+    auto future = promise->get_future();
+    sendMessageAsync(url, target, id, msg, [promise](int result) {
+        promise->set_value(result);
+    });
+    return future;
+}
+
+void SmartQQClient::sendMessageAsync(const ApiUrl& url, SendPayload::Target target,
+        int64_t id, const string& msg, SendCallback done)
+{
+    static const char* const TARGET_NAMES[] = { "friend", "group", "discuss" };
+
+    log(string("Sending message to ").append(TARGET_NAMES[target]).append(" ")
+            .append(to_string(id)).append("."));
+    log(msg);
+
+    log_debug(string("HTTP/POST ").append(url.getUrl()));
+    auto request = makeRequest(url, HttpRequest::POST);
+    int64_t msgId = MESSAGE_ID.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_load(&sendPayload)->Build(target, id, msg, msgId, request.body);
+    log_debug(request.body);
+
+    // The answer is parsed on the engine thread, it is a few bytes
+    const ApiUrl* sent = &url;
+    submit(url, std::move(request), [this, sent, done](cpr::Response r) {
+        int result;
+        try {
+            result = checkSendMsgResult(*sent, r);
+        } catch (const std::exception& e) {
+            log_err(string("Send failed. ").append(e.what()));
+            result = SEND_FAILED;
+        }
+        done(result);
+    });
 }
 
 list<Discuss> SmartQQClient::getDiscussList()
@@ -325,8 +793,8 @@ list<Discuss> SmartQQClient::getDiscussList()
     log("Getting discuss list.");
     list<Discuss> discusses;
 
-    auto r = get(SMARTQQ_API_URL(GET_DISCUSS_LIST), list<string>({psessionid, vfwebqq}));
-    auto jres = getJsonObjectResult(r);
+    auto r = get(SMARTQQ_API_URL(GET_DISCUSS_LIST), psessionid, vfwebqq);
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_DISCUSS_LIST), r);
     /*@Parse result into list
      * */
     auto _diss = jres["dnamelist"].get<list<json>>();
@@ -346,8 +814,7 @@ list<Category> SmartQQClient::getFriendListWithCategory()
     j["vfwebqq"] = vfwebqq;
     j["hash"] = hash();
 
-    auto r = post(SMARTQQ_API_URL(GET_FRIEND_LIST), j);
-    auto jres = getJsonObjectResult(r);
+    auto jres = postForResult(SMARTQQ_API_URL(GET_FRIEND_LIST), j);
     /*@Parse JSON result into list
      * */
     map<int64_t, Friend> friendMap = parseFriendMap(jres);
@@ -382,8 +849,7 @@ list<Category> SmartQQClient::getFriendListWithCategory(std::map<int64_t, Friend
     j["vfwebqq"] = vfwebqq;
     j["hash"] = hash();
 
-    auto r = post(SMARTQQ_API_URL(GET_FRIEND_LIST), j);
-    auto jres = getJsonObjectResult(r);
+    auto jres = postForResult(SMARTQQ_API_URL(GET_FRIEND_LIST), j);
     /*@Parse JSON result into list
      * */
     friendMap_ = parseFriendMap(jres);
@@ -420,8 +886,7 @@ list<Friend> SmartQQClient::getFriendList()
     j["vfwebqq"] = vfwebqq;
     j["hash"] = hash();
 
-    auto r = post(SMARTQQ_API_URL(GET_FRIEND_LIST), j);
-    auto jres = getJsonObjectResult(r);
+    auto jres = postForResult(SMARTQQ_API_URL(GET_FRIEND_LIST), j);
     /*@Parse JSON result into list
      * */
     for (auto i : parseFriendMap(jres)) {
@@ -434,10 +899,9 @@ UserInfo SmartQQClient::getAccountInfo()
 {
     log("Getting account info.");
 
-    list<string> params;
-    params.push_back(std::to_string((int64_t)std::time(nullptr)).append("012"));
-    auto r = get(SMARTQQ_API_URL(GET_ACCOUNT_INFO), params);
-    auto jres = getJsonObjectResult(r);
+    auto r = get(SMARTQQ_API_URL(GET_ACCOUNT_INFO),
+            std::to_string((int64_t)std::time(nullptr)).append("012"));
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_ACCOUNT_INFO), r);
     /*@Parse JSON result into info
      * */
 
@@ -449,8 +913,8 @@ UserInfo SmartQQClient::getFriendInfo(int64_t friendId)
 {
     log("Getting friend info.");
 
-    auto r = get(SMARTQQ_API_URL(GET_FRIEND_INFO), list<string>({to_string(friendId), vfwebqq, psessionid}));
-    auto jres = getJsonObjectResult(r);
+    auto r = get(SMARTQQ_API_URL(GET_FRIEND_INFO), friendId, vfwebqq, psessionid);
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_FRIEND_INFO), r);
     /*@Parse JSON result into info
      * */
 
@@ -469,7 +933,7 @@ list<Recent> SmartQQClient::getRecentList()
     j["psessionid"] = "";
 
     auto r = post(SMARTQQ_API_URL(GET_RECENT_LIST), j);
-    auto jres = getJsonObjectResult(r);
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_RECENT_LIST), r);
     /*@Parse JSON result into list
      * */
 
@@ -485,8 +949,8 @@ int64_t SmartQQClient::getQQById(int64_t friendId)
     log(string("Getting qq by id ").append(to_string(friendId))
             .append("."));
 
-    auto r = get(SMARTQQ_API_URL(GET_QQ_BY_ID), list<string>({to_string(friendId), vfwebqq}));
-    int64_t qq = getJsonObjectResult(r)["account"].get<int64_t>();
+    auto r = get(SMARTQQ_API_URL(GET_QQ_BY_ID), friendId, vfwebqq);
+    int64_t qq = getJsonObjectResult(SMARTQQ_API_URL(GET_QQ_BY_ID), r)["account"].get<int64_t>();
     return qq;
 }
 
@@ -495,8 +959,8 @@ list<FriendStatus> SmartQQClient::getFriendStatus()
     log("Getting friend status.");
     list<FriendStatus> fses;
 
-    auto r = get(SMARTQQ_API_URL(GET_FRIEND_STATUS), list<string>({vfwebqq, psessionid}));
-    auto jres = getJsonObjectResult(r);
+    auto r = get(SMARTQQ_API_URL(GET_FRIEND_STATUS), vfwebqq, psessionid);
+    auto jres = getJsonObjectResult(SMARTQQ_API_URL(GET_FRIEND_STATUS), r);
     /*@Parse JSON result into list
      * */
     auto _frdstss = jres.get<list<json>>();
@@ -509,56 +973,87 @@ list<FriendStatus> SmartQQClient::getFriendStatus()
 }
 
 GroupInfo SmartQQClient::getGroupInfo(int64_t groupCode)
+{
+    return getGroupInfoAsync(groupCode).get();
+}
+
+std::future<GroupInfo> SmartQQClient::getGroupInfoAsync(int64_t groupCode)
 {
     log_debug(string("Getting group info of ").append(to_string(groupCode))
             .append("."));
 
-    auto r = get(SMARTQQ_API_URL(GET_GROUP_INFO), list<string>({to_string(groupCode), vfwebqq}));
-    auto jres = getJsonObjectResult(r);
-    /*@Parse JSON result into info
-     * */
-    GroupInfo ginfo(jres["ginfo"]);
-
-    map<int64_t, GroupUser> groupUserMap;
-    for (auto i : jres["minfo"].get<list<json>>()) {
-        GroupUser gu(i);
-        groupUserMap.insert({gu.uin, gu});
+    const ApiUrl& url = SMARTQQ_API_URL(GET_GROUP_INFO);
+    if (!streamingDecode) {
+        auto r = getAsync(url, groupCode, vfwebqq);
+        return std::async(std::launch::deferred, [this](std::future<cpr::Response> r) {
+            return parseGroupInfo(getJsonObjectResult(SMARTQQ_API_URL(GET_GROUP_INFO), r.get()));
+        }, std::move(r));
     }
 
-    auto stats = jres["stats"].get<list<json>>();
-    for (auto i : stats) {
-        GroupUser& gu = groupUserMap[i["uin"]];
-        gu.clientType = i["client_type"];
-        gu.status = i["stat"];
-    }
+    auto sink = std::make_shared<JsonResultSink>();
+    auto r = submitGet(url, url.buildUrl(groupCode, vfwebqq), sink);
+    return std::async(std::launch::deferred, [this](std::future<cpr::Response> r,
+                std::shared_ptr<JsonResultSink> sink) {
+        return parseGroupInfo(getJsonObjectResult(SMARTQQ_API_URL(GET_GROUP_INFO), r.get(), *sink));
+    }, std::move(r), sink);
+}
 
-    if (jres.find("cards") != jres.end()) {
-        auto cards = jres["cards"].get<list<json>>();
-        for (auto i : cards) {
-            groupUserMap[i["muin"]].card = i["card"];
-        }
+// Calls read with the user each entry of the array jres[key] is about, by
+// its member uinKey, entries without one are skipped
+template <typename Read>
+static void readGroupUsers(const json& jres, const char* key, const char* uinKey,
+        map<int64_t, GroupUser>& users, Read read)
+{
+    auto array = jres.find(key);
+    if (array == jres.end() || !array->is_array()) return;
+    for (auto& i : *array) {
+        auto uin = i.find(uinKey);
+        if (uin == i.end() || !uin->is_number()) continue;
+        read(users[uin->get<int64_t>()], i);
     }
+}
 
-    auto vipinfos = jres["vipinfo"].get<list<json>>();
-    for (auto i : vipinfos) {
-        GroupUser& gu = groupUserMap[i["u"]];
-        gu.vip = i["is_vip"].get<int>() == 1;
-        gu.vipLevel = i["vip_level"];
-    }
+GroupInfo SmartQQClient::parseGroupInfo(const json& jres)
+{
+    /*@Parse JSON result into info
+     * */
+    auto info = jres.find("ginfo");
+    GroupInfo ginfo = info != jres.end() ? GroupInfo(*info) : GroupInfo();
 
-    for (auto i : groupUserMap) {
-        ginfo.users.push_back(i.second);
+    map<int64_t, GroupUser> groupUserMap;
+    readGroupUsers(jres, "minfo", "uin", groupUserMap,
+            [](GroupUser& gu, const json& i) { gu = GroupUser(i); });
+    readGroupUsers(jres, "stats", "uin", groupUserMap,
+            [](GroupUser& gu, const json& i) { gu.readStat(i); });
+    readGroupUsers(jres, "cards", "muin", groupUserMap,
+            [](GroupUser& gu, const json& i) { gu.readCard(i); });
+    readGroupUsers(jres, "vipinfo", "u", groupUserMap,
+            [](GroupUser& gu, const json& i) { gu.readVip(i); });
+
+    for (auto& i : groupUserMap) {
+        ginfo.users.push_back(std::move(i.second));
     }
 
     return ginfo;
 }
 
 DiscussInfo SmartQQClient::getDiscussInfo(int64_t discussId)
+{
+    return getDiscussInfoAsync(discussId).get();
+}
+
+std::future<DiscussInfo> SmartQQClient::getDiscussInfoAsync(int64_t discussId)
 {
     log_debug(string("Getting group info of ").append(to_string(discussId))
             .append("."));
-    auto r = get(SMARTQQ_API_URL(GET_DISCUSS_INFO), list<string>({to_string(discussId), vfwebqq, psessionid}));
-    auto jres = getJsonObjectResult(r);
+    auto r = getAsync(SMARTQQ_API_URL(GET_DISCUSS_INFO), discussId, vfwebqq, psessionid);
+    return std::async(std::launch::deferred, [this](std::future<cpr::Response> r) {
+        return parseDiscussInfo(getJsonObjectResult(SMARTQQ_API_URL(GET_DISCUSS_INFO), r.get()));
+    }, std::move(r));
+}
+
+DiscussInfo SmartQQClient::parseDiscussInfo(json jres)
+{
     /*@Parse JSON result into info
      * */
     DiscussInfo dinfo(jres["info"]);
@@ -613,39 +1108,107 @@ map<int64_t, Friend> SmartQQClient::parseFriendMap(const json& result)
     return friendMap;
 }
 
-cpr::Response SmartQQClient::get(const ApiUrl& url)
+size_t SmartQQClient::laneOf(const ApiUrl& url)
 {
-    log_debug(string("HTTP/GET ").append(url.getUrl()));
-    session.SetUrl(url.getUrl());
-    session.SetHeader({{"User-Agent", ApiUrl::USER_AGENT}, {"Referer", url.getReferer()}, {"Connection", "keep-alive"}});
-    session.SetCookies(cookies);
+    switch (url.getId()) {
+        case API_POLL_MESSAGE:
+            return POLL_LANE;
+        case API_SEND_MESSAGE_TO_GROUP:
+        case API_SEND_MESSAGE_TO_DISCUSS:
+        case API_SEND_MESSAGE_TO_FRIEND:
+            return SEND_LANE;
+        case API_GET_QR_CODE:
+        case API_VERIFY_QR_CODE:
+        case API_GET_PTWEBQQ:
+        case API_CGI_REPORT:
+        case API_WSPEED_CGI:
+        case API_GET_VFWEBQQ:
+        case API_GET_UIN_AND_PSESSIONID:
+            return LOGIN_LANE;
+        default:
+            return DIRECTORY_LANE;
+    }
+}
+
+void SmartQQClient::prewarm()
+{
+    if (replayer) {
+        return;
+    }
+    // A dead session answers every poll with 103, don't prewarm for each one
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t last = lastPrewarm.load();
+    if (now - last < PREWARM_INTERVAL || !lastPrewarm.compare_exchange_strong(last, now)) {
+        return;
+    }
 
-    return session.Get();
+    static const ApiId WARM[] = {
+        API_GET_QR_CODE, API_GET_VFWEBQQ, API_GET_UIN_AND_PSESSIONID,
+        API_POLL_MESSAGE, API_SEND_MESSAGE_TO_FRIEND, API_GET_GROUP_LIST
+    };
+    std::set<std::pair<size_t, string>> warmed;
+    for (ApiId id : WARM) {
+        const ApiUrl& url = apiUrlOf(id);
+        auto target = std::make_pair(laneOf(url), baseUrl.empty() ? url.getOrigin() : baseUrl);
+        if (warmed.insert(target).second) {
+            engine.Prewarm(target.first, target.second);
+        }
+    }
 }
 
-cpr::Response SmartQQClient::get(const ApiUrl& url, const list<string>& params)
+string SmartQQClient::rebase(const ApiUrl& url, string renderedUrl) const
 {
-    log_debug(string("HTTP/GET ").append(url.buildUrl(params)));
-    session.SetUrl(url.buildUrl(params));
-    session.SetHeader({{"User-Agent", ApiUrl::USER_AGENT}, {"Referer", url.getReferer()}, {"Connection", "keep-alive"}});
-    session.SetCookies(cookies);
+    // GET_PTWEBQQ has no origin, its url comes from the server already
+    const string& origin = url.getOrigin();
+    if (baseUrl.empty() || origin.empty() || renderedUrl.compare(0, origin.length(), origin) != 0) {
+        return renderedUrl;
+    }
+    return renderedUrl.replace(0, origin.length(), baseUrl);
+}
 
-    return session.Get();
+HttpRequest SmartQQClient::makeRequest(const ApiUrl& url, HttpRequest::Method method)
+{
+    HttpRequest request;
+    request.method = method;
+    request.lane = laneOf(url);
+    request.stats = &stats[url.getId()];
+    if (url.getId() == API_POLL_MESSAGE) {
+        request.cancel = pollCancel;
+    }
+    if (method == HttpRequest::POST) {
+        request.url = rebase(url, url.getUrl());
+        request.preset = postHeaders[url.getId()];
+    } else {
+        request.preset = getHeaders[url.getId()];
+    }
+    return request;
 }
 
 cpr::Response SmartQQClient::get(const ApiUrl& url, const map<string, string>& params)
 {
-    log_debug(string("HTTP/GET ").append(url.getUrl()));
-    session.SetUrl(url.getUrl());
-    session.SetHeader({{"User-Agent", ApiUrl::USER_AGENT}, {"Referer", url.getReferer()}, {"Connection", "keep-alive"}});
-    session.SetCookies(cookies);
-    cpr::Parameters _cpr_params;
+    auto request = makeRequest(url, HttpRequest::GET);
+    request.url = rebase(url, url.getUrl());
+    char sep = request.url.find('?') == string::npos ? '?' : '&';
     for (auto pair : params) {
-        _cpr_params.AddParameter({pair.first, pair.second});
+        request.url.append(1, sep).append(HttpEngine::Escape(pair.first))
+            .append("=").append(HttpEngine::Escape(pair.second));
+        sep = '&';
     }
-    session.SetParameters(std::move(_cpr_params));
+    log_debug(string("HTTP/GET ").append(request.url));
 
-    return session.Get();
+    return submit(url, std::move(request)).get();
+}
+
+std::future<cpr::Response> SmartQQClient::submitGet(const ApiUrl& url, string renderedUrl,
+        std::shared_ptr<HttpBodySink> sink)
+{
+    auto request = makeRequest(url, HttpRequest::GET);
+    request.url = rebase(url, std::move(renderedUrl));
+    request.sink = std::move(sink);
+    log_debug(string("HTTP/GET ").append(request.url));
+
+    return submit(url, std::move(request));
 }
 
 cpr::Response SmartQQClient::post(const ApiUrl& url)
@@ -654,41 +1217,97 @@ cpr::Response SmartQQClient::post(const ApiUrl& url)
 }
 
 cpr::Response SmartQQClient::post(const ApiUrl& url, const json& jparam)
+{
+    return postAsync(url, jparam).get();
+}
+
+std::future<cpr::Response> SmartQQClient::postAsync(const ApiUrl& url, const json& jparam,
+        std::shared_ptr<HttpBodySink> sink)
+{
+    auto request = makePost(url, jparam);
+    request.sink = std::move(sink);
+
+    return submit(url, std::move(request));
+}
+
+HttpRequest SmartQQClient::makePost(const ApiUrl& url, const json& jparam)
 {
     log_debug(string("HTTP/POST ").append(url.getUrl()));
     log_debug(jparam.dump());
-    session.SetUrl(url.getUrl());
-    session.SetHeader({{"User-Agent", ApiUrl::USER_AGENT}, {"Referer", url.getReferer()}, {"Origin", url.getOrigin()}, {"Connection", "keep-alive"}, {"Content-Type", "application/x-www-form-urlencoded"}, {"Accept", "*/*"}});
-    session.SetCookies(cookies);
+    auto request = makeRequest(url, HttpRequest::POST);
+    request.body = string("r=").append(HttpEngine::Escape(jparam.dump()));
+    log_debug(request.body);
+    return request;
+}
 
-    cpr::Payload _cpr_form({{"r", jparam.dump()}});
-    log_debug(_cpr_form.content);
-    session.SetPayload(std::move(_cpr_form));
+std::future<cpr::Response> SmartQQClient::submit(const ApiUrl& url, HttpRequest request)
+{
+    if (!replayer && !recorder) {
+        return engine.Submit(std::move(request));
+    }
+    auto promise = std::make_shared<std::promise<cpr::Response>>();
+    auto future = promise->get_future();
+    submit(url, std::move(request), [promise](cpr::Response r) {
+        promise->set_value(std::move(r));
+    });
+    return future;
+}
+
+void SmartQQClient::submit(const ApiUrl& url, HttpRequest request, HttpCallback done)
+{
+    if (replayer) {
+        replayer->Submit(url.getId(), std::move(request), std::move(done));
+        return;
+    }
+    if (recorder) {
+        done = recorder->Wrap(url.getId(), request, std::move(done));
+    }
+    engine.Submit(std::move(request), std::move(done));
+}
 
-    return session.Post();
+json SmartQQClient::postForResult(const ApiUrl& url, const json& jparam)
+{
+    if (!streamingDecode) {
+        return getJsonObjectResult(url, post(url, jparam));
+    }
+    auto sink = std::make_shared<JsonResultSink>();
+    auto r = postAsync(url, jparam, sink).get();
+    return getJsonObjectResult(url, r, *sink);
 }
 
-void SmartQQClient::checkSendMsgResult(const cpr::Response& r)
+int SmartQQClient::checkSendMsgResult(const ApiUrl& url, const cpr::Response& r)
 {
+    EndpointStats& s = stats[url.getId()];
     if (r.status_code != 200) {
         log_err(string("Send failed. Http status code's ").append(to_string(r.status_code)));
     }
 
-    json j = json::parse(r.text);
+    auto start = std::chrono::steady_clock::now();
+    json j;
+    try {
+        j = json::parse(r.text);
+    } catch (...) {
+        s.RecordInvalid();
+        throw;
+    }
+    s.RecordParse(microsSince(start));
     log_debug(j.dump());
     if(j.find("retcode") != j.end()) {
         int retcode = j["retcode"].get<int>();
+        s.RecordRetcode(retcode);
         if(retcode != 0) {
             log_err(string("Send failed. Api return code's ").append(to_string(retcode)));
         }
-        return;
+        return retcode;
     }
     int err_code = j["errCode"].get<int>();
+    s.RecordRetcode(err_code);
     if (err_code == 0) {
         log("Send ok.");
     } else {
         log_err(string("Send failed. Api return code's ").append(to_string(err_code)));
     }
+    return err_code;
 }
 
 string SmartQQClient::hash()
@@ -730,24 +1349,69 @@ void SmartQQClient::sleep(int64_t seconds)
     std::this_thread::sleep_for(std::chrono::seconds(seconds));
 }
 
-void SmartQQClient::close()
-{
-    mutex.lock();
-    pollStarted = false;
-    mutex.unlock();
-}
-
-json SmartQQClient::getResponseJson(const cpr::Response& r)
+json SmartQQClient::getResponseJson(const ApiUrl& url, const cpr::Response& r)
 {
+    EndpointStats& s = stats[url.getId()];
     if (r.status_code != 200) {
         throw std::runtime_error(string("Request failed. Http return code's ").append(to_string(r.status_code)));
     }
-    json ret = json::parse(r.text);
+    auto start = std::chrono::steady_clock::now();
+    json ret;
+    try {
+        ret = json::parse(r.text);
+    } catch (...) {
+        s.RecordInvalid();
+        throw;
+    }
+    s.RecordParse(microsSince(start));
     /*@TODO
      * */
     log_debug("Text of response is:");
     log_debug(ret);
-    int ret_code = ret["retcode"].get<int>();
+    auto retcode = ret.find("retcode");
+    if (retcode == ret.end() || !retcode->is_number()) {
+        s.RecordInvalid();
+        throw runtime_error("Receive an invalid response. ERR:NO RETCODE");
+    }
+    handleRetcode(url, retcode->get<int>());
+    return ret;
+}
+
+void SmartQQClient::handleRetcode(const ApiUrl& url, int retcode)
+{
+    stats[url.getId()].RecordRetcode(retcode);
+    // Only poll2 tells, other endpoints answer 103 for other reasons
+    if (url.getId() == SMARTQQ_API_URL(POLL_MESSAGE).getId()) {
+        trackSession(retcode);
+    }
+    if (retcode == 103 || retcode == 121) {
+        // The session may be gone, get the hosts ready for the next login
+        prewarm();
+    }
+    checkRetcode(retcode);
+}
+
+void SmartQQClient::trackSession(int retcode)
+{
+    if (retcode == 103 || retcode == 121) {
+        if (!sessionLost.exchange(true)) {
+            log_err(string("Session lost, poll2 return code's ").append(to_string(retcode))
+                    .append(". Polling backs off, log in again if it doesn't come back."));
+        }
+    } else if (sessionLost.exchange(false)) {
+        log("Session is back.");
+    }
+}
+
+void SmartQQClient::checkSession()
+{
+    if (sessionLost.load()) {
+        throw std::runtime_error("Session lost.");
+    }
+}
+
+void SmartQQClient::checkRetcode(int ret_code)
+{
     if(ret_code != 0) {
         if(ret_code == 103) {
             log_err(string("Request failed. Api return code's ")
@@ -757,17 +1421,16 @@ json SmartQQClient::getResponseJson(const cpr::Response& r)
             throw std::runtime_error(string("Request failed. Api return code's ").append(to_string(ret_code)));
         }
     }
-    return ret;
 }
 
-json::array_t SmartQQClient::getJsonArrayResult(const cpr::Response& r)
+json::array_t SmartQQClient::getJsonArrayResult(const ApiUrl& url, const cpr::Response& r)
 {
-    return getResponseJson(r)["result"].get<json::array_t>();
+    return getResponseJson(url, r)["result"].get<json::array_t>();
 }
 
-json SmartQQClient::getJsonObjectResult(const cpr::Response& r)
+json SmartQQClient::getJsonObjectResult(const ApiUrl& url, const cpr::Response& r)
 {
-    auto j = getResponseJson(r);
+    auto j = getResponseJson(url, r);
     if(j.find("result") != j.end()) {
         return j["result"];
     } else {
@@ -775,3 +1438,32 @@ json SmartQQClient::getJsonObjectResult(const cpr::Response& r)
     }
 }
 
+json SmartQQClient::getJsonObjectResult(const ApiUrl& url, const cpr::Response& r, JsonResultSink& sink)
+{
+    EndpointStats& s = stats[url.getId()];
+    if (r.status_code != 200) {
+        throw std::runtime_error(string("Request failed. Http return code's ").append(to_string(r.status_code)));
+    }
+    if (!sink.failed) {
+        try {
+            sink.parser.Finish();
+        } catch (const std::invalid_argument& e) {
+            sink.failed = true;
+            sink.error = e.what();
+        }
+    }
+    if (sink.failed) {
+        s.RecordInvalid();
+        throw std::invalid_argument(sink.error);
+    }
+    s.RecordParse(sink.parseMicros);
+    if (!sink.handler.hasRetcode) {
+        s.RecordInvalid();
+        throw runtime_error("Receive an invalid response. ERR:NO RETCODE");
+    }
+    handleRetcode(url, sink.handler.retcode);
+    if (!sink.handler.hasResult) {
+        throw runtime_error("Receive an invalid response. ERR:NO RESULT");
+    }
+    return std::move(sink.handler.result);
+}
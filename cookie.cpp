@@ -0,0 +1,283 @@
+#include "cookie.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <curl/curl.h>
+
+using namespace smartqq;
+
+namespace {
+
+// Offsets into a url, the path ends at the query string
+struct UrlParts {
+    std::string::size_type scheme;
+    std::string::size_type hostBegin;
+    std::string::size_type hostEnd;
+    std::string::size_type pathBegin;
+    std::string::size_type pathEnd;
+
+    bool Split(const std::string& url) {
+        scheme = url.find("://");
+        if (scheme == std::string::npos) {
+            return false;
+        }
+        hostBegin = scheme + 3;
+        hostEnd = url.find_first_of(":/?", hostBegin);
+        if (hostEnd == std::string::npos) hostEnd = url.length();
+        pathBegin = url.find_first_of("/?", hostBegin);
+        if (pathBegin == std::string::npos) pathBegin = url.length();
+        pathEnd = url.find('?', pathBegin);
+        if (pathEnd == std::string::npos) pathEnd = url.length();
+        return true;
+    }
+
+    bool HasPath(const std::string& url) const {
+        return pathBegin < pathEnd && url[pathBegin] == '/';
+    }
+};
+
+std::string trimmed(const std::string& str, std::string::size_type begin,
+        std::string::size_type end)
+{
+    while (begin < end && isspace((unsigned char)str[begin])) begin ++;
+    while (end > begin && isspace((unsigned char)str[end - 1])) end --;
+    return str.substr(begin, end - begin);
+}
+
+}
+
+CookieStore::CookieStore() : version_(0), nextExpiry_(0) {}
+
+bool CookieStore::SetCookie(const std::string& url, const std::string& header)
+{
+    UrlParts parts;
+    if (!parts.Split(url)) {
+        return false;
+    }
+
+    // name=value, then the attributes
+    auto end = std::min(header.find(';'), header.length());
+    auto equals = header.find('=');
+    if (equals >= end) {
+        return false;
+    }
+    std::string name = trimmed(header, 0, equals);
+    if (name.empty()) {
+        return false;
+    }
+
+    int64_t now = Now();
+    std::string domain = url.substr(parts.hostBegin, parts.hostEnd - parts.hostBegin);
+    // Without a Path, the directory of the url
+    std::string path = "/";
+    if (parts.HasPath(url)) {
+        auto slash = url.rfind('/', parts.pathEnd - 1);
+        if (slash > parts.pathBegin) {
+            path = url.substr(parts.pathBegin, slash - parts.pathBegin);
+        }
+    }
+    Cookie cookie;
+    cookie.tailmatch = false;
+    cookie.secure = false;
+    cookie.expires = 0;
+    cookie.value = trimmed(header, equals + 1, end);
+
+    bool maxAge = false;
+    while (end < header.length()) {
+        auto begin = end + 1;
+        end = std::min(header.find(';', begin), header.length());
+        auto separator = std::min(header.find('=', begin), end);
+        std::string attribute = trimmed(header, begin, separator);
+        std::string value = separator < end ? trimmed(header, separator + 1, end) : "";
+        std::transform(attribute.begin(), attribute.end(), attribute.begin(), ::tolower);
+        if (attribute == "domain" && !value.empty()) {
+            if (value[0] == '.') value.erase(0, 1);
+            // Only the host itself or a parent domain of it
+            if (domain != value && (domain.length() <= value.length()
+                    || domain.compare(domain.length() - value.length(), value.length(), value) != 0
+                    || domain[domain.length() - value.length() - 1] != '.')) {
+                return false;
+            }
+            domain = value;
+            cookie.tailmatch = true;
+        } else if (attribute == "path" && !value.empty() && value[0] == '/') {
+            path = value;
+        } else if (attribute == "secure") {
+            cookie.secure = true;
+        } else if (attribute == "max-age") {
+            // Wins over expires
+            int64_t seconds = std::strtoll(value.c_str(), nullptr, 10);
+            cookie.expires = seconds > 0 ? now + seconds : 1;
+            maxAge = true;
+        } else if (attribute == "expires" && !maxAge) {
+            time_t expires = curl_getdate(value.c_str(), nullptr);
+            if (expires != -1) {
+                cookie.expires = expires > 0 ? expires : 1;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto cookies = cookies_.find(domain);
+    auto key = std::make_pair(path, name);
+    if (cookie.IsExpired(now)) {
+        if (cookies == cookies_.end() || cookies->second.erase(key) == 0) {
+            return false;
+        }
+        if (cookies->second.empty()) {
+            cookies_.erase(cookies);
+        }
+        version_ ++;
+        return true;
+    }
+    if (cookies == cookies_.end()) {
+        cookies = cookies_.emplace(domain, decltype(cookies_)::mapped_type()).first;
+    }
+    if (cookie.expires != 0 && (nextExpiry_ == 0 || cookie.expires < nextExpiry_)) {
+        nextExpiry_ = cookie.expires;
+    }
+    auto old = cookies->second.find(key);
+    if (old != cookies->second.end() && old->second.value == cookie.value
+            && old->second.tailmatch == cookie.tailmatch
+            && old->second.secure == cookie.secure) {
+        // The header stays the same, a new expiry only needs keeping
+        old->second.expires = cookie.expires;
+        return false;
+    }
+    cookies->second[key] = cookie;
+    version_ ++;
+    return true;
+}
+
+void CookieStore::Expire(int64_t now)
+{
+    if (nextExpiry_ == 0 || now < nextExpiry_) {
+        return;
+    }
+    nextExpiry_ = 0;
+    for (auto domain = cookies_.begin(); domain != cookies_.end(); ) {
+        auto& cookies = domain->second;
+        for (auto i = cookies.begin(); i != cookies.end(); ) {
+            if (i->second.IsExpired(now)) {
+                i = cookies.erase(i);
+                version_ ++;
+                continue;
+            }
+            int64_t expires = i->second.expires;
+            if (expires != 0 && (nextExpiry_ == 0 || expires < nextExpiry_)) {
+                nextExpiry_ = expires;
+            }
+            ++ i;
+        }
+        if (cookies.empty()) {
+            domain = cookies_.erase(domain);
+        } else {
+            ++ domain;
+        }
+    }
+}
+
+std::shared_ptr<const std::string> CookieStore::GetHeader(const std::string& url)
+{
+    static const std::shared_ptr<const std::string> EMPTY = std::make_shared<const std::string>();
+
+    UrlParts parts;
+    if (!parts.Split(url)) {
+        return EMPTY;
+    }
+
+    // FNV-1a of everything before the query string
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < parts.pathEnd; i ++) {
+        hash = (hash ^ (unsigned char)url[i]) * 1099511628211ULL;
+    }
+
+    int64_t now = Now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    Expire(now);
+    auto cached = cache_.find(hash);
+    if (cached != cache_.end() && cached->second.version == version_
+            && cached->second.key.compare(0, std::string::npos, url, 0, parts.pathEnd) == 0) {
+        return cached->second.header;
+    }
+
+    bool secure = url.compare(0, parts.scheme, "https") == 0;
+    std::string host = url.substr(parts.hostBegin, parts.hostEnd - parts.hostBegin);
+    const char* path = parts.HasPath(url) ? url.data() + parts.pathBegin : "/";
+    size_t pathLength = parts.HasPath(url) ? parts.pathEnd - parts.pathBegin : 1;
+
+    CachedHeader& entry = cache_[hash];
+    entry.version = version_;
+    entry.key = url.substr(0, parts.pathEnd);
+    entry.header = Encode(secure, host, path, pathLength);
+    return entry.header;
+}
+
+std::shared_ptr<const std::string> CookieStore::Encode(bool secure, const std::string& host,
+        const char* path, size_t pathLength) const
+{
+    std::vector<std::pair<size_t, std::string>> matched;
+
+    // The host itself, then every parent domain for tailmatching cookies
+    for (std::string::size_type begin = 0; begin != std::string::npos; ) {
+        auto domain = cookies_.find(host.substr(begin));
+        if (domain != cookies_.end()) {
+            for (auto& i : domain->second) {
+                const std::string& cpath = i.first.first;
+                const Cookie& cookie = i.second;
+                if (begin != 0 && !cookie.tailmatch) continue;
+                if (cookie.secure && !secure) continue;
+                if (cpath.length() > pathLength || cpath.compare(0, cpath.length(), path, cpath.length()) != 0) continue;
+                if (cpath.length() < pathLength && cpath.back() != '/' && path[cpath.length()] != '/') continue;
+                matched.push_back({cpath.length(), std::string(i.first.second).append("=").append(cookie.value)});
+            }
+        }
+        begin = host.find('.', begin);
+        if (begin != std::string::npos) begin ++;
+    }
+
+    // Longer paths first
+    std::stable_sort(matched.begin(), matched.end(),
+            [](const std::pair<size_t, std::string>& a, const std::pair<size_t, std::string>& b) {
+                return a.first > b.first;
+            });
+    auto header = std::make_shared<std::string>();
+    for (auto& i : matched) {
+        if (!header->empty()) header->append("; ");
+        header->append(i.second);
+    }
+    return header;
+}
+
+std::string CookieStore::Get(const std::string& name) const
+{
+    int64_t now = Now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& domain : cookies_) {
+        for (auto& i : domain.second) {
+            if (i.first.second == name && !i.second.IsExpired(now)) {
+                return i.second.value;
+            }
+        }
+    }
+    return "";
+}
+
+void CookieStore::Clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    cookies_.clear();
+    cache_.clear();
+    nextExpiry_ = 0;
+    version_ ++;
+}
+
+uint64_t CookieStore::GetVersion() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return version_;
+}
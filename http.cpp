@@ -0,0 +1,468 @@
+#include "http.hpp"
+
+#include <cctype>
+#include <memory>
+#include <stdexcept>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace smartqq;
+
+struct HttpEngine::Transfer {
+    HttpRequest request;
+    HttpCallback callback;
+    CURL* handle;
+    curl_slist* headers;
+    // Set-Cookie values and the url of the hop that sent them, empty for
+    // most responses
+    std::vector<std::pair<std::string, std::string>> setCookies;
+    cpr::Response response;
+
+    Transfer() : handle(nullptr), headers(nullptr) {}
+};
+
+HttpHeaders::HttpHeaders(const std::vector<std::string>& lines) :
+    lines_(lines), list_(nullptr)
+{
+    for (auto& line : lines_) {
+        list_ = curl_slist_append(list_, line.c_str());
+    }
+}
+
+HttpHeaders::~HttpHeaders()
+{
+    curl_slist_free_all(list_);
+}
+
+HttpEngine::HttpEngine(const std::vector<HttpLane>& lanes) : running_(true)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    multi_ = curl_multi_init();
+    wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (multi_ == nullptr || wakeup_fd_ < 0) {
+        throw std::runtime_error("Failed to initialize the http engine.");
+    }
+    for (auto& lane : lanes) {
+        lanes_.push_back(LaneState(lane));
+        // Only the event loop thread uses the share, so no lock callbacks are
+        // needed. TLS sessions survive the handle that negotiated them and
+        // a reconnect resumes instead of doing a full handshake.
+        CURLSH* share = curl_share_init();
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        // Give the lane a connection cache of its own
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+        lanes_.back().share = share;
+    }
+    thread_ = std::thread(&HttpEngine::Loop, this);
+}
+
+HttpEngine::~HttpEngine()
+{
+    running_ = false;
+    Wakeup();
+    thread_.join();
+
+    for (auto handle : idle_handles_) {
+        curl_easy_cleanup(handle);
+    }
+    for (auto& lane : lanes_) {
+        if (lane.share != nullptr) curl_share_cleanup(lane.share);
+    }
+    curl_multi_cleanup(multi_);
+    ::close(wakeup_fd_);
+}
+
+std::future<cpr::Response> HttpEngine::Submit(HttpRequest request)
+{
+    auto promise = std::make_shared<std::promise<cpr::Response>>();
+    auto future = promise->get_future();
+    Submit(std::move(request), [promise](cpr::Response r) {
+        promise->set_value(std::move(r));
+    });
+    return future;
+}
+
+void HttpEngine::Submit(HttpRequest request, HttpCallback callback)
+{
+    if (request.lane >= lanes_.size()) {
+        throw std::out_of_range("No such http lane.");
+    }
+    Transfer* transfer = new Transfer;
+    transfer->request = std::move(request);
+    transfer->callback = std::move(callback);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(transfer);
+    }
+    Wakeup();
+}
+
+void HttpEngine::Cancel(const std::shared_ptr<std::atomic<bool>>& flag)
+{
+    flag->store(true);
+    Wakeup();
+}
+
+void HttpEngine::Prewarm(size_t lane, const std::string& origin)
+{
+    HttpRequest request;
+    request.method = HttpRequest::HEAD;
+    request.url = origin + "/";
+    request.laneCookies = false;
+    request.timeout = PREWARM_TIMEOUT;
+    request.lane = lane;
+    // The connection stays in the lane's cache, the response is of no use
+    Submit(std::move(request), [](cpr::Response) {});
+}
+
+std::string HttpEngine::Escape(const std::string& str)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    std::string ret;
+    ret.reserve(str.length() * 3);
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            ret.push_back(c);
+        } else {
+            ret.push_back('%');
+            ret.push_back(HEX[c >> 4]);
+            ret.push_back(HEX[c & 0xf]);
+        }
+    }
+    return ret;
+}
+
+void HttpEngine::Wakeup()
+{
+    uint64_t one = 1;
+    ssize_t n = ::write(wakeup_fd_, &one, sizeof(one));
+    (void)n;
+}
+
+CURL* HttpEngine::AcquireHandle()
+{
+    if (idle_handles_.empty()) {
+        return curl_easy_init();
+    }
+    CURL* handle = idle_handles_.back();
+    idle_handles_.pop_back();
+    curl_easy_reset(handle);
+    return handle;
+}
+
+void HttpEngine::Loop()
+{
+    while (running_) {
+        std::deque<Transfer*> pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending.swap(pending_);
+        }
+        for (auto transfer : pending) {
+            lanes_[transfer->request.lane].waiting.push_back(transfer);
+        }
+        FinishCancelled();
+        for (size_t lane = 0; lane < lanes_.size(); lane ++) {
+            Schedule(lane);
+        }
+
+        int running_handles = 0;
+        curl_multi_perform(multi_, &running_handles);
+
+        CURLMsg* msg;
+        int left = 0;
+        while ((msg = curl_multi_info_read(multi_, &left)) != nullptr) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            Transfer* transfer = nullptr;
+            CURLcode code = msg->data.result;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+            Finish(transfer, code);
+        }
+
+        curl_waitfd wakeup;
+        wakeup.fd = wakeup_fd_;
+        wakeup.events = CURL_WAIT_POLLIN;
+        wakeup.revents = 0;
+        curl_multi_wait(multi_, &wakeup, 1, 1000, nullptr);
+        if (wakeup.revents != 0) {
+            uint64_t count;
+            ssize_t n = ::read(wakeup_fd_, &count, sizeof(count));
+            (void)n;
+        }
+    }
+
+    // Fail everything still in flight so that no future is left hanging
+    std::deque<Transfer*> pending;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending.swap(pending_);
+    }
+    for (auto transfer : pending) {
+        Abort(transfer);
+    }
+    for (auto& lane : lanes_) {
+        for (auto transfer : lane.waiting) {
+            Abort(transfer);
+        }
+        lane.waiting.clear();
+    }
+    std::set<Transfer*> active;
+    active.swap(active_);
+    for (auto transfer : active) {
+        Finish(transfer, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+static bool isCancelled(const HttpRequest& request)
+{
+    return request.cancel && request.cancel->load();
+}
+
+void HttpEngine::FinishCancelled()
+{
+    std::vector<Transfer*> cancelled;
+    for (auto transfer : active_) {
+        if (isCancelled(transfer->request)) cancelled.push_back(transfer);
+    }
+    for (auto& lane : lanes_) {
+        for (auto i = lane.waiting.begin(); i != lane.waiting.end(); ) {
+            if (isCancelled((*i)->request)) {
+                Abort(*i);
+                i = lane.waiting.erase(i);
+            } else {
+                ++ i;
+            }
+        }
+    }
+    for (auto transfer : cancelled) {
+        Finish(transfer, CURLE_ABORTED_BY_CALLBACK);
+    }
+}
+
+void HttpEngine::Schedule(size_t lane)
+{
+    LaneState& state = lanes_[lane];
+    while (!state.waiting.empty() && state.active < state.config.connections) {
+        Transfer* transfer = state.waiting.front();
+        state.waiting.pop_front();
+        Start(transfer);
+    }
+}
+
+void HttpEngine::Start(Transfer* transfer)
+{
+    const HttpRequest& request = transfer->request;
+    LaneState& lane = lanes_[request.lane];
+    CURL* handle = AcquireHandle();
+    transfer->handle = handle;
+    lane.active ++;
+
+    std::shared_ptr<const std::string> cookies;
+    if (request.cookies.empty() && request.laneCookies && lane.config.cookies) {
+        cookies = lane.config.cookies->GetHeader(request.url);
+    }
+
+    // The preset list is used as is, only extra lines need a list of our own
+    curl_slist* headers = request.preset ? request.preset->GetList() : nullptr;
+    if (!request.headers.empty()) {
+        if (request.preset) {
+            for (auto& line : request.preset->GetLines()) {
+                transfer->headers = curl_slist_append(transfer->headers, line.c_str());
+            }
+        }
+        for (auto& line : request.headers) {
+            transfer->headers = curl_slist_append(transfer->headers, line.c_str());
+        }
+        headers = transfer->headers;
+    }
+
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(handle, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(handle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, request.method != HttpRequest::HEAD ? 1L : 0L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    // Entries live in the multi handle and are shared by every lane
+    curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, DNS_CACHE_TIMEOUT);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, request.timeout);
+    // The cookie engine carries what a hop sets to the next one of a
+    // redirect, the store learns it from the Set-Cookie headers
+    curl_easy_setopt(handle, CURLOPT_COOKIEFILE, "");
+    if (!request.cookies.empty()) {
+        curl_easy_setopt(handle, CURLOPT_COOKIE, request.cookies.c_str());
+    } else if (cookies && !cookies->empty()) {
+        curl_easy_setopt(handle, CURLOPT_COOKIE, cookies->c_str());
+    }
+    if (lane.share != nullptr) {
+        curl_easy_setopt(handle, CURLOPT_SHARE, lane.share);
+    }
+    if (request.method == HttpRequest::HEAD) {
+        curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+    } else if (request.method == HttpRequest::POST) {
+        curl_easy_setopt(handle, CURLOPT_POST, 1L);
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, (long)request.body.length());
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request.body.data());
+    }
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &HttpEngine::WriteCallback);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, &HttpEngine::HeaderCallback);
+    curl_easy_setopt(handle, CURLOPT_HEADERDATA, transfer);
+
+    active_.insert(transfer);
+    if (curl_multi_add_handle(multi_, handle) != CURLM_OK) {
+        Finish(transfer, CURLE_FAILED_INIT);
+    }
+}
+
+static cpr::ErrorCode toErrorCode(CURLcode code)
+{
+    switch (code) {
+        case CURLE_OK:
+            return cpr::ErrorCode::OK;
+        case CURLE_COULDNT_RESOLVE_HOST:
+            return cpr::ErrorCode::HOST_RESOLUTION_FAILURE;
+        case CURLE_COULDNT_CONNECT:
+            return cpr::ErrorCode::CONNECTION_FAILURE;
+        case CURLE_OPERATION_TIMEDOUT:
+            return cpr::ErrorCode::OPERATION_TIMEDOUT;
+        case CURLE_GOT_NOTHING:
+            return cpr::ErrorCode::EMPTY_RESPONSE;
+        case CURLE_SEND_ERROR:
+            return cpr::ErrorCode::NETWORK_SEND_FAILURE;
+        case CURLE_RECV_ERROR:
+            return cpr::ErrorCode::NETWORK_RECEIVE_ERROR;
+        case CURLE_SSL_CONNECT_ERROR:
+            return cpr::ErrorCode::SSL_CONNECT_ERROR;
+        default:
+            return cpr::ErrorCode::INTERNAL_ERROR;
+    }
+}
+
+void HttpEngine::Finish(Transfer* transfer, CURLcode code)
+{
+    std::unique_ptr<Transfer> guard(transfer);
+    CURL* handle = transfer->handle;
+    cpr::Response& response = transfer->response;
+
+    curl_multi_remove_handle(multi_, handle);
+    active_.erase(transfer);
+    lanes_[transfer->request.lane].active --;
+
+    long status_code = 0;
+    char* effective_url = nullptr;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status_code);
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME, &response.elapsed);
+    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &effective_url);
+    response.status_code = code == CURLE_OK ? status_code : 0;
+    response.url = effective_url != nullptr ? effective_url : transfer->request.url;
+    response.error.code = toErrorCode(code);
+    response.error.message = curl_easy_strerror(code);
+
+    if (transfer->request.stats != nullptr && code == CURLE_ABORTED_BY_CALLBACK) {
+        // Cancelled or shut down, how long it ran says nothing of the endpoint
+        transfer->request.stats->RecordAbort();
+    } else if (transfer->request.stats != nullptr) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+        curl_off_t downloaded = 0;
+        curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+#else
+        double downloaded = 0;
+        curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &downloaded);
+#endif
+        transfer->request.stats->RecordTransfer(response.status_code,
+                (uint64_t)(response.elapsed * 1e6), (uint64_t)downloaded,
+                transfer->request.body.length());
+    }
+
+    if (!transfer->setCookies.empty()) {
+        CookieStore* store = transfer->request.laneCookies ?
+            lanes_[transfer->request.lane].config.cookies.get() : nullptr;
+        for (auto& i : transfer->setCookies) {
+            const std::string& value = i.second;
+            if (store != nullptr) {
+                store->SetCookie(i.first, value);
+            }
+            auto end = value.find(';');
+            auto equals = value.find('=');
+            if (equals < end) {
+                response.cookies[value.substr(0, equals)] = value.substr(equals + 1,
+                        end == std::string::npos ? end : end - equals - 1);
+            }
+        }
+        // The next transfer of the handle starts without them
+        curl_easy_setopt(handle, CURLOPT_COOKIELIST, "ALL");
+    }
+
+    curl_slist_free_all(transfer->headers);
+    transfer->headers = nullptr;
+    idle_handles_.push_back(handle);
+
+    try {
+        transfer->callback(std::move(response));
+    } catch (...) {
+        // A throwing callback must not take the event loop down
+    }
+
+    if (running_) {
+        Schedule(transfer->request.lane);
+    }
+}
+
+void HttpEngine::Abort(Transfer* transfer)
+{
+    std::unique_ptr<Transfer> guard(transfer);
+    cpr::Response& response = transfer->response;
+    response.status_code = 0;
+    response.elapsed = 0;
+    response.url = transfer->request.url;
+    response.error.code = toErrorCode(CURLE_ABORTED_BY_CALLBACK);
+    response.error.message = curl_easy_strerror(CURLE_ABORTED_BY_CALLBACK);
+    if (transfer->request.stats != nullptr) {
+        transfer->request.stats->RecordAbort();
+    }
+    try {
+        transfer->callback(std::move(response));
+    } catch (...) {
+    }
+}
+
+size_t HttpEngine::WriteCallback(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    Transfer* transfer = static_cast<Transfer*>(userdata);
+    if (transfer->request.sink) {
+        transfer->request.sink->Write(ptr, size * nmemb);
+    } else {
+        transfer->response.text.append(ptr, size * nmemb);
+    }
+    return size * nmemb;
+}
+
+size_t HttpEngine::HeaderCallback(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+    Transfer* transfer = static_cast<Transfer*>(userdata);
+    std::string line(ptr, size * nmemb);
+    if (line.compare(0, 5, "HTTP/") == 0) {
+        // A new status line, headers of a redirect hop are dropped
+        transfer->response.header.clear();
+    } else {
+        auto colon = line.find(':');
+        if (colon != std::string::npos) {
+            auto begin = line.find_first_not_of(' ', colon + 1);
+            auto end = line.find_last_not_of("\r\n");
+            std::string value = begin == std::string::npos || end < begin ?
+                "" : line.substr(begin, end - begin + 1);
+            if (colon == 10 && strncasecmp(line.data(), "Set-Cookie", 10) == 0) {
+                // Domain and path default to the hop's
+                char* url = nullptr;
+                curl_easy_getinfo(transfer->handle, CURLINFO_EFFECTIVE_URL, &url);
+                transfer->setCookies.emplace_back(url != nullptr ? url : transfer->request.url,
+                        value);
+            }
+            transfer->response.header[line.substr(0, colon)] = value;
+        }
+    }
+    return size * nmemb;
+}
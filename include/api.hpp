@@ -3,42 +3,123 @@
 
 #include <string>
 #include <list>
+#include <vector>
+#include <cstdint>
 
 #include "smartqq.hpp"
 
 NAMESPACE_BEGIN(smartqq)
 
+// Stable id of every endpoint, usable as an array index
+enum ApiId {
+    API_GET_QR_CODE,
+    API_VERIFY_QR_CODE,
+    API_CGI_REPORT,
+    API_WSPEED_CGI,
+    API_GET_PTWEBQQ,
+    API_GET_VFWEBQQ,
+    API_GET_UIN_AND_PSESSIONID,
+    API_GET_GROUP_LIST,
+    API_POLL_MESSAGE,
+    API_SEND_MESSAGE_TO_GROUP,
+    API_GET_FRIEND_LIST,
+    API_SEND_MESSAGE_TO_FRIEND,
+    API_GET_DISCUSS_LIST,
+    API_SEND_MESSAGE_TO_DISCUSS,
+    API_GET_ACCOUNT_INFO,
+    API_GET_RECENT_LIST,
+    API_GET_FRIEND_STATUS,
+    API_GET_GROUP_INFO,
+    API_GET_QQ_BY_ID,
+    API_GET_DISCUSS_INFO,
+    API_GET_FRIEND_INFO,
+    API_COUNT
+};
+
+/* One argument of ApiUrl::buildUrl, either a borrowed string or an integer
+ * formatted into the inline buffer. Only lives for the call. */
+struct ApiArg {
+    ApiArg(const std::string& str) : str(str.data()), length(str.length()) {}
+
+    ApiArg(const char* str) : str(str), length(std::char_traits<char>::length(str)) {}
+
+    ApiArg(int x) : ApiArg((long long)x) {}
+
+    ApiArg(long x) : ApiArg((long long)x) {}
+
+    ApiArg(long long x) : str(nullptr) {
+        char tmp[sizeof(buf)];
+        size_t n = 0;
+        unsigned long long u = x < 0 ? 0ULL - (unsigned long long)x : x;
+        do {
+            tmp[n ++] = '0' + u % 10;
+            u /= 10;
+        } while (u != 0);
+        length = 0;
+        if (x < 0) buf[length ++] = '-';
+        while (n != 0) buf[length ++] = tmp[-- n];
+    }
+
+    const char* data() const {
+        return str != nullptr ? str : buf;
+    }
+
+    const char* str;
+    size_t length;
+    char buf[24];
+};
+
+/* An endpoint template. The "{##}" slots are located once at construction,
+ * rendering then only concatenates the literal fragments and the arguments
+ * into a string sized up front. */
 struct ApiUrl {
     static const std::string USER_AGENT;
 
-    ApiUrl(const std::string &url, const std::string &referer) :
-        url(url), referer(referer) {}
+    ApiUrl(ApiId id, const std::string &url, const std::string &referer);
+
+    ApiId getId() const {
+        return id;
+    }
 
-    std::string getUrl() const {
+    const std::string& getUrl() const {
         return url;
     }
 
-    std::string getReferer() const {
+    const std::string& getReferer() const {
         return referer;
     }
 
-    std::string getOrigin() const {
-        if (url.find_first_of('/') != std::string::npos)
-            return url.substr(0, url.find_first_of('/', 7));
-        else return url;
+    const std::string& getOrigin() const {
+        return origin;
     }
 
-    std::string buildUrl(const std::list<std::string>& paramList) const {
-        std::string __url = this->url;
-        for (auto i : paramList) {
-            __url = __url.replace(__url.find_first_of("{##}"), 4, i);
-        }
-        return __url;
+    size_t getSlotCount() const {
+        return fragments.size() - 1;
     }
 
+    std::string buildUrl() const {
+        return render(nullptr, 0);
+    }
+
+    template <typename... Args>
+    std::string buildUrl(const Args&... args) const {
+        const ApiArg argv[] = {ApiArg(args)...};
+        return render(argv, sizeof...(Args));
+    }
+
+    std::string buildUrl(const std::list<std::string>& paramList) const;
+
+    // throw invalid_argument if count doesn't match the number of slots
+    std::string render(const ApiArg* args, size_t count) const;
+
 private:
+    ApiId id;
     std::string url;
     std::string referer;
+    std::string origin;
+    // Literal text around the slots, one more than the number of slots
+    std::vector<std::string> fragments;
+    size_t literalLength;
 };
 
 extern const ApiUrl
@@ -66,5 +147,10 @@ __GET_FRIEND_INFO;
 
 #define SMARTQQ_API_URL(URL_NAME) __##URL_NAME
 
+const ApiUrl& apiUrlOf(ApiId id);
+
+// Short name of the endpoint, e.g. "poll2"
+const char* apiNameOf(ApiId id);
+
 NAMESPACE_END(smartqq)
 #endif
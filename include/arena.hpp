@@ -0,0 +1,130 @@
+#ifndef __SMARTQQ_ARENA_H__
+#define __SMARTQQ_ARENA_H__
+
+#include "smartqq.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+NAMESPACE_BEGIN(smartqq)
+
+class MessageArenaPool;
+
+/* Bump allocator for the payloads of one poll's messages. Nothing is freed
+ * on its own, Reset() rewinds it and keeps the blocks for the next poll.
+ * Allocate is not thread-safe, the decoder fills an arena before anyone
+ * else sees it. */
+class MessageArena {
+public:
+    static const size_t DEFAULT_BLOCK_SIZE = 16 * 1024;
+
+    explicit MessageArena(size_t blockSize = DEFAULT_BLOCK_SIZE);
+
+    MessageArena(const MessageArena&) = delete;
+
+    MessageArena& operator=(const MessageArena&) = delete;
+
+    // align must be a power of two
+    void* Allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    char* CopyString(const char* data, size_t length);
+
+    void Reset();
+
+    // Bytes held in blocks, used or not
+    size_t GetCapacity() const;
+
+private:
+    friend class MessageArenaRef;
+    friend class MessageArenaPool;
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    const size_t blockSize_;
+    std::vector<Block> blocks_;
+    // Block being filled and the offset in it
+    size_t current_;
+    size_t offset_;
+
+    std::atomic<int> refs_;
+    MessageArenaPool* pool_;
+};
+
+/* Shared ownership of a pooled arena. Every message decoded into an arena
+ * holds one, the arena goes back to its pool once the last is gone. Copies
+ * may be made and dropped on any thread. */
+class MessageArenaRef {
+public:
+    MessageArenaRef() : arena_(nullptr) {}
+
+    MessageArenaRef(const MessageArenaRef& other);
+
+    MessageArenaRef(MessageArenaRef&& other) : arena_(other.arena_) {
+        other.arena_ = nullptr;
+    }
+
+    MessageArenaRef& operator=(MessageArenaRef other) {
+        std::swap(arena_, other.arena_);
+        return *this;
+    }
+
+    ~MessageArenaRef();
+
+    MessageArena* get() const {
+        return arena_;
+    }
+
+    MessageArena& operator*() const {
+        return *arena_;
+    }
+
+    explicit operator bool() const {
+        return arena_ != nullptr;
+    }
+
+private:
+    friend class MessageArenaPool;
+
+    explicit MessageArenaRef(MessageArena* arena);
+
+    MessageArena* arena_;
+};
+
+/* Arenas for the polls in flight. In steady state as many exist as polls
+ * are queued or being dispatched, and none is created or freed. Must
+ * outlive every MessageArenaRef it handed out. */
+class MessageArenaPool {
+public:
+    explicit MessageArenaPool(size_t blockSize = MessageArena::DEFAULT_BLOCK_SIZE);
+
+    MessageArenaPool(const MessageArenaPool&) = delete;
+
+    MessageArenaPool& operator=(const MessageArenaPool&) = delete;
+
+    // An empty arena, recycled if one is free
+    MessageArenaRef Acquire();
+
+    // Arenas ever created
+    size_t GetCreated() const;
+
+private:
+    friend class MessageArenaRef;
+
+    void Recycle(MessageArena* arena);
+
+    const size_t blockSize_;
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<MessageArena>> arenas_;
+    std::vector<MessageArena*> free_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
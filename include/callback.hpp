@@ -13,6 +13,27 @@ public:
     virtual void onMessage(const Message& message) = 0;
     virtual void onGroupMessage(const GroupMessage& message) = 0;
     virtual void onDiscussMessage(const DiscussMessage& message) = 0;
+
+    // The messages of a poll, in order. Override it to handle them as a
+    // batch, by default each goes to the matching call above.
+    virtual void onMessages(const MessageEvent* events, size_t count) {
+        for (size_t i = 0; i < count; i ++) {
+            const MessageEvent& event = events[i];
+            switch (event.type) {
+            case MessageEvent::FRIEND_MESSAGE:
+                onMessage(event.message);
+                break;
+            case MessageEvent::GROUP_MESSAGE:
+                onGroupMessage(event.groupMessage);
+                break;
+            case MessageEvent::DISCUSS_MESSAGE:
+                onDiscussMessage(event.discussMessage);
+                break;
+            default:
+                break;
+            }
+        }
+    }
 };
 
 NAMESPACE_END(smartqq)
@@ -5,21 +5,38 @@
 #include "model.hpp"
 #include "callback.hpp"
 #include "api.hpp"
+#include "http.hpp"
+#include "traffic.hpp"
+#include "msgqueue.hpp"
+#include "recentids.hpp"
+#include "polldecode.hpp"
+#include "sendpayload.hpp"
+#include "outbound.hpp"
 
 /* Use JSON library from https://github.com/hlohmann/json
  * Convenient copy 2016.02.18*/
 #include <json.hpp>
 
 #include <map>
+#include <deque>
 #include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <ostream>
 
 #include <cpr/cpr.h>
 
 NAMESPACE_BEGIN(smartqq)
 
+class JsonResultSink;
+
 class SmartQQClient {
 public:
-    static int64_t MESSAGE_ID;
+    // Taken by every send, from whichever thread
+    static std::atomic<int64_t> MESSAGE_ID;
     static const int64_t Client_ID;
 
     string ptwebqq;
@@ -29,6 +46,10 @@ public:
 
     SmartQQClient();
 
+    // Closes and waits for the poll thread. Destroying the client from a
+    // message callback terminates the program, close() there instead.
+    ~SmartQQClient();
+
     void login();
 
     void getQRCode();
@@ -53,6 +74,43 @@ public:
 
     void sendMessageToFriend(int64_t friendId, const string& msg);
 
+    // Return once the request is queued on the send lane, the future gets
+    // the retcode or errCode of the answer, SEND_FAILED if there is none.
+    // Safe from any thread, concurrent sends share the lane's connections.
+    std::future<int> sendMessageToGroupAsync(int64_t groupId, const string& msg);
+
+    std::future<int> sendMessageToDiscussAsync(int64_t discussId, const string& msg);
+
+    std::future<int> sendMessageToFriendAsync(int64_t friendId, const string& msg);
+
+    // Sent by the outbound scheduler once the rate limits allow, in order
+    // per target and priority. False if too many messages of priority or
+    // more urgent ones are queued already, else done gets the result, see
+    // SendScheduler::Enqueue. Plugins use these instead of sending and
+    // sleeping on the dispatch thread, replies to a user as
+    // SEND_INTERACTIVE, broadcasts as SEND_BULK.
+    bool queueMessageToGroup(int64_t groupId, const string& msg,
+            SendCallback done = nullptr, SendPriority priority = SEND_NORMAL);
+
+    bool queueMessageToDiscuss(int64_t discussId, const string& msg,
+            SendCallback done = nullptr, SendPriority priority = SEND_NORMAL);
+
+    bool queueMessageToFriend(int64_t friendId, const string& msg,
+            SendCallback done = nullptr, SendPriority priority = SEND_NORMAL);
+
+    // Rates the queued messages go out at
+    void setSendLimits(const SendLimits& limits);
+
+    // Merge queued messages to the same target into fewer sends, off by
+    // default
+    void setSendCoalescing(const SendCoalescing& coalescing);
+
+    // Strict priorities by default
+    void setSendPriorities(const SendPriorities& priorities);
+
+    // Depth, sent and throttled counts of the queued messages
+    const SendScheduler& getSendScheduler() const;
+
     list<Group> getGroupList();
 
     list<Discuss> getDiscussList();
@@ -73,21 +131,103 @@ public:
 
     GroupInfo getGroupInfo(int64_t groupCode);
 
+    // The request is in flight once this returns, parsing happens on get()
+    std::future<GroupInfo> getGroupInfoAsync(int64_t groupCode);
+
     DiscussInfo getDiscussInfo(int64_t discussId);
 
+    std::future<DiscussInfo> getDiscussInfoAsync(int64_t discussId);
+
     int64_t getQQById(int64_t friendId);
 
+    // Does nothing while a poll thread is running or closing
     void startPolling(MessageCallback& callback);
 
+    // Stop polling. The outstanding poll2 is cancelled and queued messages
+    // are dropped, so this returns once a running plugin callback does.
+    // Called from a callback, it returns at once and the poll thread exits
+    // after the callback.
+    void close();
+
+    // Whether poll2 says the session is gone. Polling goes on slowly, a
+    // bot seeing this for long should login() again.
+    bool isSessionLost() const;
+
+    // Messages are handed to the callback of startPolling on a thread of
+    // their own, through a queue of capacity. overflow says what a poll that
+    // finds it full does, see MessageQueue. Set it while not polling.
+    void setMessageQueue(size_t capacity, MessageQueue::Overflow overflow,
+            unsigned droppable = MessageQueue::DEFAULT_DROPPABLE);
+
+    // Depth and drop counts of the message queue
+    const MessageQueue& getMessageQueue() const;
+
+    // Keep two staggered poll2 requests outstanding, so one is always waiting
+    // at the server while the other's messages are handled. Messages both
+    // return are dispatched once. Off by default, set it before startPolling.
+    void setDoublePolling(bool enable);
+
+    // Send every request to baseUrl ("http://host:port") instead of the qq.com
+    // hosts, e.g. to the stub server in tools/. Set it before login().
+    void setBaseUrl(const string& baseUrl);
+
+    // Append every request/response pair to a traffic log at path
+    void recordTraffic(const string& path);
+
+    // Answer every request from a traffic log at path, nothing is sent
+    void replayTraffic(const string& path, TrafficReplayer::Speed speed);
+
+    // Decode large directory responses while they arrive and poll2 responses
+    // without a json DOM, on by default
+    void setStreamingDecode(bool enable);
+
+    // Latency, bytes, http status and retcode counts of one endpoint
+    const EndpointStats& getStats(ApiId id) const;
+
+    // One line per endpoint that has seen traffic
+    void dumpStats(std::ostream& out) const;
+
 private:
 
+    // Index into the lanes of engine, see the constructor
+    enum Lane { LOGIN_LANE, POLL_LANE, SEND_LANE, DIRECTORY_LANE };
+
+    static size_t laneOf(const ApiUrl& url);
+
+    // Open connections to the hosts of the login steps and of the lanes used
+    // right after them, so login never waits on DNS, TCP or TLS setup
+    void prewarm();
+
+    // renderedUrl with the origin of url swapped for baseUrl, if one is set
+    string rebase(const ApiUrl& url, string renderedUrl) const;
+
     void pollThread(MessageCallback &callback);
 
-    static map<int64_t, Friend> parseFriendMap(const nlohmann::json& json);
+    nlohmann::json pollParams() const;
+
+    // The response lands in pollResponses
+    void submitPoll();
 
-    cpr::Response get(const ApiUrl& url);
+    // Messages of a poll2 response, seen ones left out. keys gets theirs,
+    // to be remembered once they are queued.
+    void handlePoll(const cpr::Response& r, vector<MessageEvent>& events,
+            vector<uint64_t>& keys);
 
-    cpr::Response get(const ApiUrl& url, const list<string>& params);
+    // Pops the message queue into callback until it is closed
+    void dispatchThread(MessageCallback& callback);
+
+    // Whether the message value of type was seen before, in an earlier
+    // poll or earlier in this one, by its sender, ids and time. Else its
+    // key goes to keys.
+    bool isRecentMessage(MessageEvent::Type type, const nlohmann::json& value,
+            vector<uint64_t>& keys);
+
+    static map<int64_t, Friend> parseFriendMap(const nlohmann::json& json);
+
+    template <typename... Args>
+    cpr::Response get(const ApiUrl& url, const Args&... args) {
+        return getAsync(url, args...).get();
+    }
 
     cpr::Response get(const ApiUrl& url, const map<string, string>& params);
 
@@ -95,7 +235,44 @@ private:
 
     cpr::Response post(const ApiUrl& url, const nlohmann::json& jparam);
 
-    static void checkSendMsgResult(const cpr::Response& r);
+    // args fill the "{##}" slots of url in order
+    template <typename... Args>
+    std::future<cpr::Response> getAsync(const ApiUrl& url, const Args&... args) {
+        return submitGet(url, url.buildUrl(args...));
+    }
+
+    std::future<cpr::Response> submitGet(const ApiUrl& url, string renderedUrl,
+            std::shared_ptr<HttpBodySink> sink = nullptr);
+
+    std::future<cpr::Response> postAsync(const ApiUrl& url, const nlohmann::json& jparam,
+            std::shared_ptr<HttpBodySink> sink = nullptr);
+
+    // post() followed by getJsonObjectResult(), streamed if enabled
+    nlohmann::json postForResult(const ApiUrl& url, const nlohmann::json& jparam);
+
+    HttpRequest makeRequest(const ApiUrl& url, HttpRequest::Method method);
+
+    // A POST carrying jparam as the "r" form field
+    HttpRequest makePost(const ApiUrl& url, const nlohmann::json& jparam);
+
+    // Through the replayer if there is one, else the engine, recorded if asked
+    std::future<cpr::Response> submit(const ApiUrl& url, HttpRequest request);
+
+    void submit(const ApiUrl& url, HttpRequest request, HttpCallback done);
+
+    // Posts msg to id through url, one of the send_*_msg2
+    std::future<int> sendMessageAsync(const ApiUrl& url, SendPayload::Target target,
+            int64_t id, const string& msg);
+
+    // The same, done gets the result on the engine thread
+    void sendMessageAsync(const ApiUrl& url, SendPayload::Target target, int64_t id,
+            const string& msg, SendCallback done);
+
+    // Runs on the scheduler thread, returns once the send is submitted
+    void sendQueued(const OutboundMessage& message, SendCallback done);
+
+    // The retcode or errCode of the answer, errors are logged
+    int checkSendMsgResult(const ApiUrl& url, const cpr::Response& r);
 
     string hash();
 
@@ -103,21 +280,116 @@ private:
 
     static string hash(int64_t x, string K);
 
-    void close();
+    // The getters below record parse time and retcode into the stats of url
+    nlohmann::json getResponseJson(const ApiUrl& url, const cpr::Response& r);
+
+    nlohmann::json::array_t getJsonArrayResult(const ApiUrl& url, const cpr::Response& r);
+
+    nlohmann::json getJsonObjectResult(const ApiUrl& url, const cpr::Response& r);
+
+    nlohmann::json getJsonObjectResult(const ApiUrl& url, const cpr::Response& r, JsonResultSink& sink);
+
+    // Records retcode into the stats of url, then checkRetcode(). A poll2
+    // retcode goes to trackSession() too.
+    void handleRetcode(const ApiUrl& url, int retcode);
+
+    // Raises or lowers sessionLost by the retcode of a poll2, a loss is
+    // logged as an error
+    void trackSession(int retcode);
+
+    // throw runtime_error while the session is lost
+    void checkSession();
+
+    static void checkRetcode(int retcode);
+
+    static GroupInfo parseGroupInfo(const nlohmann::json& jres);
+
+    static DiscussInfo parseDiscussInfo(nlohmann::json jres);
+
+    // Indexed by ApiId, declared before engine which writes into it
+    std::unique_ptr<EndpointStats[]> stats;
+
+    // Shared by every lane, filled by the responses of the login steps
+    std::shared_ptr<CookieStore> cookies;
+
+    // Both outlive engine, whose callbacks may still reach them
+    std::unique_ptr<TrafficRecorder> recorder;
+
+    std::unique_ptr<TrafficReplayer> replayer;
+
+    HttpEngine engine;
+
+    // Headers of every endpoint, built once in the constructor
+    std::shared_ptr<const HttpHeaders> getHeaders[API_COUNT];
+
+    std::shared_ptr<const HttpHeaders> postHeaders[API_COUNT];
+
+    enum PollState { POLL_STOPPED, POLL_RUNNING, POLL_CLOSING };
+
+    std::atomic<int> pollState;
+
+    // Raised by a poll2 answering 103 or 121, polls back off the most until
+    // one succeeds or getUinAndPsessionid() lowers it
+    std::atomic<bool> sessionLost;
+
+    std::thread poller;
+
+    // Carried by every poll2 request, close() raises it to cancel them
+    std::shared_ptr<std::atomic<bool>> pollCancel;
+
+    // 1, or 2 with double polling
+    size_t pollDepth;
+
+    // Guards pollResponses, pollWakeup signals a response or close()
+    std::mutex pollMutex;
+
+    std::condition_variable pollWakeup;
+
+    std::deque<cpr::Response> pollResponses;
+
+    // Payloads of the decoded polls, before messages so it outlives the queue
+    MessageArenaPool arenas;
+
+    // Keys of the last RECENT_MESSAGES messages
+    RecentIds recentMessages;
+
+    PollDecoder pollDecoder;
+
+    // Keys of the poll handlePoll is on, for the json path
+    BatchIds pollBatch;
+
+    static const size_t RECENT_MESSAGES = 1024;
+
+    std::unique_ptr<MessageQueue> messages;
+
+    static const size_t MESSAGE_QUEUE_CAPACITY = 1024;
+
+    // The client whose callbacks this thread runs, if any
+    static thread_local SmartQQClient* dispatching;
+
+    // In milliseconds, between the polls of a double poll
+    static const int64_t POLL_STAGGER = 500;
+
+    // In milliseconds, doubled on each consecutive failed poll
+    static const int64_t POLL_BACKOFF_MIN = 100;
 
-    static nlohmann::json getResponseJson(const cpr::Response& r);
+    static const int64_t POLL_BACKOFF_MAX = 10000;
 
-    static nlohmann::json::array_t getJsonArrayResult(const cpr::Response& r);
+    // Bodies of send_*_msg2, replaced by getUinAndPsessionid(). Read and
+    // swapped with atomic_load and atomic_store.
+    std::shared_ptr<const SendPayload> sendPayload;
 
-    static nlohmann::json getJsonObjectResult(const cpr::Response& r);
+    bool streamingDecode;
 
-    cpr::Session session;
+    string baseUrl;
 
-    cpr::Cookies cookies;
+    // Steady clock milliseconds of the last prewarm
+    std::atomic<int64_t> lastPrewarm;
 
-    bool pollStarted;
+    static const int64_t PREWARM_INTERVAL = 10000;
 
-    std::mutex mutex;
+    // Last, its thread sends through everything above
+    SendScheduler outbound;
 };
 
 NAMESPACE_END(smartqq)
@@ -0,0 +1,80 @@
+#ifndef __SMARTQQ_COOKIE_H__
+#define __SMARTQQ_COOKIE_H__
+
+#include "smartqq.hpp"
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+#include <ctime>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Cookie jar keyed by domain and path. The Cookie header for a url is
+ * encoded once and served from a cache until a Set-Cookie actually changes
+ * the jar or a cookie in it expires. Safe to use from several threads. */
+class CookieStore {
+public:
+    CookieStore();
+
+    // Value of a Set-Cookie header of a response from url, returns whether
+    // the jar changed. One that expires the cookie removes it, that is how
+    // servers delete cookies.
+    bool SetCookie(const std::string& url, const std::string& header);
+
+    // Cookie header value for a request to url, empty if nothing matches
+    std::shared_ptr<const std::string> GetHeader(const std::string& url);
+
+    // Value of the first cookie called name, whatever its domain
+    std::string Get(const std::string& name) const;
+
+    void Clear();
+
+    // Bumped on every change
+    uint64_t GetVersion() const;
+
+private:
+    struct Cookie {
+        bool tailmatch;
+        bool secure;
+        // Seconds since the epoch, 0 for a session cookie
+        int64_t expires;
+        std::string value;
+
+        bool IsExpired(int64_t now) const {
+            return expires != 0 && expires <= now;
+        }
+    };
+
+    struct CachedHeader {
+        uint64_t version;
+        std::string key;
+        std::shared_ptr<const std::string> header;
+    };
+
+    // Drops the cookies expired by now, with mutex_ held
+    void Expire(int64_t now);
+
+    std::shared_ptr<const std::string> Encode(bool secure, const std::string& host,
+            const char* path, size_t pathLength) const;
+
+    static int64_t Now() {
+        return (int64_t)std::time(nullptr);
+    }
+
+    mutable std::mutex mutex_;
+    uint64_t version_;
+    // Domain without the leading dot, then (path, name)
+    std::map<std::string, std::map<std::pair<std::string, std::string>, Cookie>> cookies_;
+    // When the first cookie expires, 0 if none does
+    int64_t nextExpiry_;
+    // Keyed by a hash of scheme, host and path of the url
+    std::unordered_map<uint64_t, CachedHeader> cache_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef __SMARTQQ_HTTP_H__
+#define __SMARTQQ_HTTP_H__
+
+#include "smartqq.hpp"
+#include "stats.hpp"
+#include "cookie.hpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#include <curl/curl.h>
+#include <cpr/cpr.h>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* An immutable, prepared header list. Requests share it by pointer, so
+ * attaching it to a transfer allocates nothing. */
+class HttpHeaders {
+public:
+    // "Name: value" lines
+    explicit HttpHeaders(const std::vector<std::string>& lines);
+
+    ~HttpHeaders();
+
+    HttpHeaders(const HttpHeaders&) = delete;
+
+    HttpHeaders& operator=(const HttpHeaders&) = delete;
+
+    curl_slist* GetList() const {
+        return list_;
+    }
+
+    const std::vector<std::string>& GetLines() const {
+        return lines_;
+    }
+
+private:
+    std::vector<std::string> lines_;
+    curl_slist* list_;
+};
+
+/* Receives the response body chunk by chunk instead of Response::text.
+ * Write runs on the event loop thread and must not throw. */
+class HttpBodySink {
+public:
+    virtual ~HttpBodySink() {}
+
+    virtual void Write(const char* data, size_t length) = 0;
+};
+
+struct HttpRequest {
+    enum Method { GET, POST, HEAD };
+
+    Method method;
+    std::string url;
+    // Sent before headers
+    std::shared_ptr<const HttpHeaders> preset;
+    // "Name: value" lines
+    std::vector<std::string> headers;
+    // Value of the Cookie header, sent as is instead of the lane's cookies
+    std::string cookies;
+    // Whether the lane's cookie store is read and updated
+    bool laneCookies;
+    std::string body;
+    // In milliseconds, 0 means no timeout
+    long timeout;
+    // Index of the lane the request is queued on
+    size_t lane;
+    // If set, the body goes here and Response::text stays empty
+    std::shared_ptr<HttpBodySink> sink;
+    // If set, gets latency, bytes and status when the transfer finishes
+    EndpointStats* stats;
+    // Once true, the request fails with CURLE_ABORTED_BY_CALLBACK, see Cancel
+    std::shared_ptr<std::atomic<bool>> cancel;
+
+    HttpRequest() : method(GET), laneCookies(true), timeout(0), lane(0),
+        stats(nullptr) {}
+};
+
+/* A lane is an independent FIFO with its own connection cache and its own
+ * view of the cookie jar. At most `connections` requests of one lane are in
+ * flight, so a busy lane never steals connections from another one. */
+struct HttpLane {
+    std::string name;
+    size_t connections;
+    // Supplies the Cookie header and takes the Set-Cookie of every response
+    std::shared_ptr<CookieStore> cookies;
+
+    HttpLane(const std::string& name, size_t connections,
+            std::shared_ptr<CookieStore> cookies = nullptr) :
+        name(name), connections(connections), cookies(cookies) {}
+};
+
+typedef std::function<void(cpr::Response)> HttpCallback;
+
+/* Non-blocking HTTP engine on top of a curl multi handle.
+ * Every transfer is driven by a single event loop thread, requests submitted
+ * from other threads are handed over through a queue and an eventfd wakeup.
+ * Callbacks run on the event loop thread and must not block. */
+class HttpEngine {
+public:
+    explicit HttpEngine(const std::vector<HttpLane>& lanes =
+            std::vector<HttpLane>{HttpLane("default", 8)});
+
+    ~HttpEngine();
+
+    std::future<cpr::Response> Submit(HttpRequest request);
+
+    void Submit(HttpRequest request, HttpCallback callback);
+
+    // Raise flag and fail every request carrying it, queued or in flight,
+    // without waiting for its response
+    void Cancel(const std::shared_ptr<std::atomic<bool>>& flag);
+
+    // Open a connection to origin ("scheme://host[:port]") on the lane in the
+    // background, so the next request there skips DNS, TCP and TLS setup
+    void Prewarm(size_t lane, const std::string& origin);
+
+    // Percent-encode everything but unreserved characters, like curl_easy_escape
+    static std::string Escape(const std::string& str);
+
+private:
+    // In seconds, resolved hosts outlive the 60s libcurl default
+    static const long DNS_CACHE_TIMEOUT = 3600;
+
+    // In milliseconds
+    static const long PREWARM_TIMEOUT = 5000;
+
+    struct Transfer;
+
+    struct LaneState {
+        HttpLane config;
+        CURLSH* share;
+        size_t active;
+        std::deque<Transfer*> waiting;
+
+        LaneState(const HttpLane& config) : config(config), share(nullptr),
+            active(0) {}
+    };
+
+    void Loop();
+
+    void Schedule(size_t lane);
+
+    void Start(Transfer* transfer);
+
+    void Finish(Transfer* transfer, CURLcode code);
+
+    // Fail a transfer that never got a handle
+    void Abort(Transfer* transfer);
+
+    void FinishCancelled();
+
+    void Wakeup();
+
+    CURL* AcquireHandle();
+
+    static size_t WriteCallback(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+    static size_t HeaderCallback(char* ptr, size_t size, size_t nmemb, void* userdata);
+
+    CURLM* multi_;
+    int wakeup_fd_;
+    std::atomic<bool> running_;
+
+    std::mutex mutex_;
+    // Submitted but not yet added to the multi handle, guarded by mutex_
+    std::deque<Transfer*> pending_;
+
+    // Only touched by the event loop thread
+    std::vector<LaneState> lanes_;
+    std::set<Transfer*> active_;
+    std::vector<CURL*> idle_handles_;
+
+    std::thread thread_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
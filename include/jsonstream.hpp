@@ -0,0 +1,138 @@
+#ifndef __SMARTQQ_JSONSTREAM_H__
+#define __SMARTQQ_JSONSTREAM_H__
+
+#include "smartqq.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <json.hpp>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Events of JsonStreamParser. Strings passed to onKey/onString are only
+ * valid during the call. */
+class JsonHandler {
+public:
+    virtual ~JsonHandler() {}
+
+    virtual void onNull() = 0;
+    virtual void onBool(bool value) = 0;
+    virtual void onInteger(int64_t value) = 0;
+    virtual void onFloat(double value) = 0;
+    virtual void onString(const std::string& value) = 0;
+    virtual void onKey(const std::string& key) = 0;
+    virtual void onStartObject() = 0;
+    virtual void onEndObject() = 0;
+    virtual void onStartArray() = 0;
+    virtual void onEndArray() = 0;
+};
+
+/* Incremental JSON tokenizer. The document can be fed in chunks of any size,
+ * tokens split across chunks are carried over in a reused buffer. */
+class JsonStreamParser {
+public:
+    explicit JsonStreamParser(JsonHandler& handler);
+
+    // throw invalid_argument on malformed input
+    void Feed(const char* data, size_t length);
+
+    // throw invalid_argument if the document is incomplete
+    void Finish();
+
+    bool IsDone() const {
+        return state_ == DONE;
+    }
+
+    void Reset();
+
+private:
+    enum State {
+        VALUE,
+        FIRST_VALUE_OR_END,
+        FIRST_KEY_OR_END,
+        KEY,
+        COLON,
+        AFTER_VALUE,
+        DONE
+    };
+
+    enum Lexeme { NONE, STRING, ESCAPE, UNICODE, NUMBER, LITERAL };
+
+    void BeginValue(char c);
+
+    void EndValue();
+
+    void EndContainer(char c);
+
+    void EmitString();
+
+    void EmitNumber();
+
+    void EmitLiteral();
+
+    void AppendCodePoint(uint32_t cp);
+
+    void FlushSurrogate();
+
+    void Error(const char* what) const;
+
+    JsonHandler& handler_;
+    State state_;
+    Lexeme lexeme_;
+    // Whether the string being lexed is an object key
+    bool key_;
+    std::vector<char> stack_;
+    std::string token_;
+    uint32_t unicode_;
+    int unicodeDigits_;
+    uint32_t highSurrogate_;
+    size_t offset_;
+};
+
+/* Builds the "result" member of an api response straight into a json value
+ * and keeps "retcode"/"errCode", every other member is skipped. */
+class JsonResultHandler : public JsonHandler {
+public:
+    JsonResultHandler();
+
+    void onNull();
+    void onBool(bool value);
+    void onInteger(int64_t value);
+    void onFloat(double value);
+    void onString(const std::string& value);
+    void onKey(const std::string& key);
+    void onStartObject();
+    void onEndObject();
+    void onStartArray();
+    void onEndArray();
+
+    bool hasRetcode;
+    int retcode;
+    bool hasErrCode;
+    int errCode;
+    bool hasResult;
+    nlohmann::json result;
+
+private:
+    void onStartContainer(nlohmann::json&& init);
+
+    void onEndContainer();
+
+    void onScalar(nlohmann::json&& value);
+
+    nlohmann::json& insert(nlohmann::json&& value);
+
+    int depth_;
+    // Current member of the top level object
+    std::string member_;
+    // Current key inside result
+    std::string key_;
+    // Containers of result being built, innermost last
+    std::vector<nlohmann::json*> stack_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -6,8 +6,16 @@
 #include <list>
 #include <cstdlib>
 #include <sstream>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
 
 #include "smartqq.hpp"
+#include "arena.hpp"
 
 #include <json.hpp>
 
@@ -15,34 +23,118 @@ NAMESPACE_BEGIN(smartqq)
 
 using namespace std;
 
+/* A member of a model struct and the key it is read from. A struct's json
+ * constructor walks the members of the object once and hands each value to
+ * the entry of its key, so there is one key dispatch per member and no
+ * lookup per field. Keys the table lacks are skipped, fields the object
+ * lacks and values of another type leave the member as it was. */
+template <typename T>
+struct JsonField {
+    const char* key;
+    // Of key, entries of another length are passed over without a compare
+    size_t length;
+    void (*read)(T& object, const nlohmann::json& value);
+};
+
+inline void readJsonValue(string& out, const nlohmann::json& value) {
+    if (value.is_string()) out = value.get_ref<const string&>();
+}
+
+inline void readJsonValue(int64_t& out, const nlohmann::json& value) {
+    if (value.is_number()) out = value.get<int64_t>();
+}
+
+inline void readJsonValue(int& out, const nlohmann::json& value) {
+    if (value.is_number()) out = value.get<int>();
+}
+
+// The api says 1 for true, like vip_info and is_vip
+inline void readJsonValue(bool& out, const nlohmann::json& value) {
+    if (value.is_boolean()) out = value.get<bool>();
+    else if (value.is_number()) out = value.get<int>() == 1;
+}
+
+template <size_t N>
+void readJsonValue(int (&out)[N], const nlohmann::json& value) {
+    if (!value.is_array()) return;
+    size_t i = 0;
+    for (auto& v : value) {
+        if (i == N) break;
+        readJsonValue(out[i ++], v);
+    }
+}
+
+// A nested model struct
+template <typename T>
+void readJsonValue(T& out, const nlohmann::json& value) {
+    if (value.is_object()) out = T(value);
+}
+
+template <typename T, typename M, M T::*member>
+void readJsonMember(T& object, const nlohmann::json& value) {
+    readJsonValue(object.*member, value);
+}
+
+template <typename T, size_t N>
+void readJsonFields(T& object, const nlohmann::json& json, const JsonField<T> (&fields)[N]) {
+    auto members = json.get_ptr<const nlohmann::json::object_t*>();
+    if (members == nullptr) return;
+    for (auto& member : *members) {
+        const string& key = member.first;
+        if (key.empty()) continue;
+        for (size_t i = 0; i < N; i ++) {
+            const JsonField<T>& field = fields[i];
+            if (field.length == key.size() && field.key[0] == key[0]
+                    && std::memcmp(field.key, key.data(), field.length) == 0) {
+                field.read(object, member.second);
+                break;
+            }
+        }
+    }
+}
+
+// An entry of a constexpr JsonField<Type> table, key a string literal
+#define SMARTQQ_JSON_FIELD(Type, member, key) \
+    SMARTQQ_JSON_READER(key, (&smartqq::readJsonMember<Type, decltype(Type::member), &Type::member>))
+
+// The same, the value read by a function of its own
+#define SMARTQQ_JSON_READER(key, read) \
+    {key, sizeof(key) - 1, read}
+
 struct Birthday {
-    int year;
-    int month;
-    int day;
+    int year = 0;
+    int month = 0;
+    int day = 0;
 
     Birthday() {}
 
-    Birthday(nlohmann::json json) {
-        year = json["year"];
-        month = json["month"];
-        day = json["day"];
+    Birthday(const nlohmann::json& json) {
+        static constexpr JsonField<Birthday> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Birthday, year, "year"),
+            SMARTQQ_JSON_FIELD(Birthday, month, "month"),
+            SMARTQQ_JSON_FIELD(Birthday, day, "day"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
 struct Friend;
 
 struct Category {
-    int index;
-    int sort;
+    int index = 0;
+    int sort = 0;
     string name;
     list<Friend> friends;
 
     Category() {}
 
-    Category(nlohmann::json json) {
-        index = json["index"];
-        sort = json["sort"];
-        name = json["name"];
+    Category(const nlohmann::json& json) {
+        static constexpr JsonField<Category> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Category, index, "index"),
+            SMARTQQ_JSON_FIELD(Category, sort, "sort"),
+            SMARTQQ_JSON_FIELD(Category, name, "name"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 
     static Category defaultCategory() {
@@ -55,49 +147,56 @@ struct Category {
 };
 
 struct DiscussUser {
-    int64_t uin;
+    int64_t uin = 0;
     string nick;
-    int clientType;
+    int clientType = 0;
     string status;
 
     DiscussUser() {}
 
-    DiscussUser(nlohmann::json json) {
-        uin = json["uin"];
-        nick = json["nick"];
-        /*
-         *clientType = json["client_type"];
-         *status = json["status"];
-         */
+    DiscussUser(const nlohmann::json& json) {
+        static constexpr JsonField<DiscussUser> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(DiscussUser, uin, "uin"),
+            SMARTQQ_JSON_FIELD(DiscussUser, nick, "nick"),
+            SMARTQQ_JSON_FIELD(DiscussUser, clientType, "client_type"),
+            SMARTQQ_JSON_FIELD(DiscussUser, status, "status"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
 struct DiscussInfo {
     //@did
-    int64_t id;
+    int64_t id = 0;
     //@discu_name
     string name;
     list<DiscussUser> users;
 
     DiscussInfo() {}
 
-    DiscussInfo(nlohmann::json json) {
-        id = json["did"];
-        name = json["discu_name"];
+    DiscussInfo(const nlohmann::json& json) {
+        static constexpr JsonField<DiscussInfo> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(DiscussInfo, id, "did"),
+            SMARTQQ_JSON_FIELD(DiscussInfo, name, "discu_name"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
 struct Discuss {
-    int64_t id;
+    int64_t id = 0;
     string name;
 
     DiscussInfo dinfo;
 
     Discuss() {}
 
-    Discuss(nlohmann::json json) {
-        id = json["did"].get<int64_t>();
-        name = json["name"];
+    Discuss(const nlohmann::json& json) {
+        static constexpr JsonField<Discuss> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Discuss, id, "did"),
+            SMARTQQ_JSON_FIELD(Discuss, name, "name"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
@@ -106,10 +205,10 @@ struct Font;
 struct Font {
     static const Font DEFAULT_FONT;
 
-    int style[3];
+    int style[3] = {0, 0, 0};
     string color;
     string name;
-    int size;
+    int size = 0;
 
     static Font defaultFont() {
         Font font;
@@ -122,14 +221,20 @@ struct Font {
 
     Font() {}
 
-    Font(nlohmann::json json) {
-        color = json["color"].get<string>();
-        name = json["name"].get<string>();
-        size = json["size"].get<int>();
-        int j = 0;
-        for (auto i : json["style"].get<vector<int>>()) {
-            style[j ++] = i;
-        }
+    Font(const nlohmann::json& json) {
+        static constexpr JsonField<Font> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Font, color, "color"),
+            SMARTQQ_JSON_FIELD(Font, name, "name"),
+            SMARTQQ_JSON_FIELD(Font, size, "size"),
+            SMARTQQ_JSON_FIELD(Font, style, "style"),
+        };
+        readJsonFields(*this, json, FIELDS);
+    }
+
+    bool operator==(const Font& other) const {
+        return size == other.size && style[0] == other.style[0]
+            && style[1] == other.style[1] && style[2] == other.style[2]
+            && color == other.color && name == other.name;
     }
 
     string toString() const {
@@ -144,31 +249,392 @@ struct Font {
     }
 };
 
+/* The fonts seen so far, each under a small id and with its toString()
+ * done once. Senders stick to a handful of fonts, so a decoded message only
+ * has to look its font up, and that takes no lock once the font is known.
+ * Entries are never removed, ids stay valid for the life of the process.
+ * Safe to use from several threads. */
+class FontTable {
+public:
+    // Past it, new fonts get the id of the default font
+    static const uint32_t MAX_FONTS = 1024;
+
+    // Id of Font::defaultFont()
+    static const uint32_t DEFAULT_ID = 0;
+
+    static FontTable& instance();
+
+    FontTable(const FontTable&) = delete;
+
+    FontTable& operator=(const FontTable&) = delete;
+
+    // The fields of a font, its strings borrowed from wherever they were read
+    struct Key {
+        const string* color;
+        const string* name;
+        int size;
+        int style[3];
+
+        explicit Key(const Font& font);
+
+        // The fields Font(json) would read, json must outlive the key
+        explicit Key(const nlohmann::json& json);
+    };
+
+    // Id of font, added if it is new
+    uint32_t intern(const Font& font) {
+        return intern(Key(font));
+    }
+
+    uint32_t intern(const Key& key);
+
+    const Font& get(uint32_t id) const;
+
+    const string& toString(uint32_t id) const;
+
+    size_t size() const {
+        return count_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Entry {
+        Font font;
+        string json;
+    };
+
+    FontTable();
+
+    static uint64_t hashOf(const Key& key);
+
+    static bool matches(const Font& font, const Key& key);
+
+    // Slot of key, or the free one ending its probe sequence
+    uint32_t probe(const Key& key, uint64_t hash) const;
+
+    static const uint32_t SLOTS = MAX_FONTS * 2;
+
+    // Taken to add a font only
+    std::mutex mutex_;
+    std::unique_ptr<Entry> entries_[MAX_FONTS];
+    std::atomic<uint32_t> count_;
+    // Open addressing over entries_, id + 1 or 0 for a free slot. A slot is
+    // stored after its entry, so a reader that sees it sees the entry.
+    std::atomic<uint32_t> slots_[SLOTS];
+};
+
+/* A font of FontTable, as small as its id. The default one is
+ * Font::defaultFont(). */
+class FontRef {
+public:
+    FontRef() : id_(FontTable::DEFAULT_ID) {}
+
+    explicit FontRef(const Font& font) : id_(FontTable::instance().intern(font)) {}
+
+    explicit FontRef(const FontTable::Key& key) : id_(FontTable::instance().intern(key)) {}
+
+    uint32_t id() const {
+        return id_;
+    }
+
+    const Font& operator*() const {
+        return FontTable::instance().get(id_);
+    }
+
+    const Font* operator->() const {
+        return &FontTable::instance().get(id_);
+    }
+
+    // Font::toString(), without serializing it again
+    const string& toString() const {
+        return FontTable::instance().toString(id_);
+    }
+
+    bool operator==(const FontRef& other) const {
+        return id_ == other.id_;
+    }
+
+private:
+    uint32_t id_;
+};
+
+/* Segments of a message's content: text, faces and whatever else the server
+ * sends, like ["cface", ...]. Texts and names share one buffer and the first
+ * INLINE_SEGMENTS segments are kept inside the object, so a usual message
+ * needs at most the buffer's allocation. str() renders the whole content the
+ * old way, faces as "/face#10", once and on demand. Like a std::string it
+ * must not be read from several threads while str() may be first called.
+ *
+ * Decoded poll messages borrow their buffer and segments from the poll's
+ * MessageArena instead, so they allocate nothing. Copying a content always
+ * makes an owned one, keep copies of what should outlive the callback. */
+class MessageContent {
+public:
+    enum Kind { TEXT, FACE, OTHER };
+
+    // Valid until the content changes
+    struct SegmentView {
+        Kind kind;
+        // TEXT: the text, OTHER: the name of the segment
+        const char* data;
+        size_t length;
+        // FACE: the face id, OTHER: its trailing number if any
+        int64_t number;
+
+        string toString() const {
+            return string(data, length);
+        }
+    };
+
+    static const size_t INLINE_SEGMENTS = 4;
+
+    MessageContent() : count_(0), borrowedData_(nullptr), borrowedSegments_(nullptr),
+        borrowedLength_(0), rendered_(false) {}
+
+    // The content array of a message, font segments are skipped
+    MessageContent(const nlohmann::json& json) : MessageContent() {
+        for (auto& segment : json) {
+            if (segment.is_string()) {
+                appendText(segment.get_ref<const string&>());
+            } else if (segment.is_array() && !segment.empty() && segment[0].is_string()) {
+                const string& name = segment[0].get_ref<const string&>();
+                const nlohmann::json& last = segment[segment.size() - 1];
+                int64_t number = last.is_number_integer() ? last.get<int64_t>() : 0;
+                if (name == "face") {
+                    appendFace(number);
+                } else if (name != "font") {
+                    appendOther(name.data(), name.length(), number);
+                }
+            }
+        }
+    }
+
+    // other, borrowing from arena. Valid while arena isn't reset.
+    MessageContent(const MessageContent& other, MessageArena& arena) : MessageContent() {
+        count_ = other.count_;
+        size_t length = other.dataLength();
+        borrowedData_ = arena.CopyString(other.data(), length);
+        Segment* segments = (Segment*)arena.Allocate(sizeof(Segment) * count_, alignof(Segment));
+        for (size_t i = 0; i < count_; i ++) {
+            segments[i] = other.segment(i);
+        }
+        borrowedSegments_ = segments;
+        borrowedLength_ = length;
+    }
+
+    MessageContent(const MessageContent& other) : MessageContent() {
+        if (!other.isBorrowed()) {
+            count_ = other.count_;
+            std::copy(other.inline_, other.inline_ + (count_ < INLINE_SEGMENTS ? count_ : INLINE_SEGMENTS), inline_);
+            overflow_ = other.overflow_;
+            buffer_ = other.buffer_;
+            rendered_ = other.rendered_;
+            text_ = other.text_;
+            return;
+        }
+        buffer_.assign(other.borrowedData_, other.borrowedLength_);
+        for (size_t i = 0; i < other.count_; i ++) {
+            push(other.borrowedSegments_[i]);
+        }
+    }
+
+    MessageContent(MessageContent&& other) : MessageContent() {
+        moveFrom(other);
+    }
+
+    MessageContent& operator=(const MessageContent& other) {
+        if (this != &other) {
+            *this = MessageContent(other);
+        }
+        return *this;
+    }
+
+    MessageContent& operator=(MessageContent&& other) {
+        if (this != &other) {
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    void appendText(const char* data, size_t length) {
+        append(TEXT, data, length, 0);
+    }
+
+    void appendText(const string& text) {
+        append(TEXT, text.data(), text.length(), 0);
+    }
+
+    void appendFace(int64_t id) {
+        append(FACE, nullptr, 0, id);
+    }
+
+    void appendOther(const char* name, size_t length, int64_t number) {
+        append(OTHER, name, length, number);
+    }
+
+    // Keeps the buffers' capacity
+    void clear() {
+        count_ = 0;
+        overflow_.clear();
+        buffer_.clear();
+        borrowedData_ = nullptr;
+        borrowedSegments_ = nullptr;
+        rendered_ = false;
+        text_.clear();
+    }
+
+    size_t size() const {
+        return count_;
+    }
+
+    bool empty() const {
+        return count_ == 0;
+    }
+
+    bool isBorrowed() const {
+        return borrowedSegments_ != nullptr;
+    }
+
+    SegmentView operator[](size_t i) const {
+        const Segment& s = segment(i);
+        SegmentView view;
+        view.kind = (Kind)s.kind;
+        view.data = data() + s.offset;
+        view.length = s.length;
+        view.number = s.number;
+        return view;
+    }
+
+    const string& str() const {
+        if (!rendered_) {
+            text_.clear();
+            for (size_t i = 0; i < count_; i ++) {
+                SegmentView s = (*this)[i];
+                if (s.kind == TEXT) {
+                    text_.append(s.data, s.length);
+                } else {
+                    text_.append("/").append(s.kind == FACE ? "face" : string(s.data, s.length))
+                        .append("#").append(std::to_string(s.number));
+                }
+            }
+            rendered_ = true;
+        }
+        return text_;
+    }
+
+    operator const string&() const {
+        return str();
+    }
+
+private:
+    struct Segment {
+        uint8_t kind;
+        uint32_t offset;
+        uint32_t length;
+        int64_t number;
+    };
+
+    const Segment& segment(size_t i) const {
+        if (isBorrowed()) return borrowedSegments_[i];
+        return i < INLINE_SEGMENTS ? inline_[i] : overflow_[i - INLINE_SEGMENTS];
+    }
+
+    const char* data() const {
+        return isBorrowed() ? borrowedData_ : buffer_.data();
+    }
+
+    size_t dataLength() const {
+        return isBorrowed() ? borrowedLength_ : buffer_.length();
+    }
+
+    // Leaves other empty
+    void moveFrom(MessageContent& other) {
+        count_ = other.count_;
+        std::copy(other.inline_, other.inline_ + (count_ < INLINE_SEGMENTS ? count_ : INLINE_SEGMENTS), inline_);
+        overflow_ = std::move(other.overflow_);
+        buffer_ = std::move(other.buffer_);
+        borrowedData_ = other.borrowedData_;
+        borrowedSegments_ = other.borrowedSegments_;
+        borrowedLength_ = other.borrowedLength_;
+        rendered_ = other.rendered_;
+        text_ = std::move(other.text_);
+        other.clear();
+    }
+
+    void push(const Segment& s) {
+        if (count_ < INLINE_SEGMENTS) {
+            inline_[count_] = s;
+        } else {
+            overflow_.push_back(s);
+        }
+        count_ ++;
+    }
+
+    void append(Kind kind, const char* data, size_t length, int64_t number) {
+        if (isBorrowed()) {
+            *this = MessageContent(*this);
+        }
+        Segment s;
+        s.kind = (uint8_t)kind;
+        s.offset = (uint32_t)buffer_.length();
+        s.length = (uint32_t)length;
+        s.number = number;
+        buffer_.append(data, length);
+        push(s);
+        rendered_ = false;
+    }
+
+    Segment inline_[INLINE_SEGMENTS];
+    vector<Segment> overflow_;
+    size_t count_;
+    string buffer_;
+    // Set for content borrowed from an arena, buffer_ and inline_ unused
+    const char* borrowedData_;
+    const Segment* borrowedSegments_;
+    size_t borrowedLength_;
+    mutable bool rendered_;
+    mutable string text_;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const MessageContent& content)
+{
+    return out << content.str();
+}
+
+// [["font", {...}], "text", ["face", 10], ...] into font and content
+template <typename T>
+void readMessageContent(T& message, const nlohmann::json& value) {
+    if (!value.is_array()) return;
+    if (!value.empty() && value[0].is_array() && !value[0].empty()) {
+        // Usually interned already, no Font is built for it then
+        message.font = FontRef(FontTable::Key(value[0].back()));
+    }
+    message.content = MessageContent(value);
+}
+
 struct DiscussMessage {
-    int64_t did;
-    int64_t time;
-    string content;
-    int64_t uid;
-    Font font;
+    int64_t did = 0;
+    int64_t time = 0;
+    MessageContent content;
+    int64_t uid = 0;
+    FontRef font;
+    // Given by the server, 0 if missing. poll2 may deliver a message twice.
+    int64_t msgId = 0;
+    int64_t msgId2 = 0;
+    int msgType = 0;
 
     DiscussMessage() {}
 
-    DiscussMessage(nlohmann::json json) {
-        time = json["time"].get<int64_t>();
-        did = json["did"].get<int64_t>();
-        uid = json["send_uin"].get<int64_t>();
-        auto _content = json["content"].get<vector<nlohmann::json>>();
-        font = Font(_content.front().
-                get<list<nlohmann::json>>().back());
-        auto msg = _content.back();
-        if(msg.is_array()) {
-            // ["face", 10]
-            auto _face = msg.get<vector<nlohmann::json>>();
-            content = string("/").append(_face.front().get<string>())
-                .append("#")
-                .append(std::to_string(_face.back().get<int>()));
-            // "/face#10"
-        } else content = msg.get<string>();
+    DiscussMessage(const nlohmann::json& json) {
+        static constexpr JsonField<DiscussMessage> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(DiscussMessage, did, "did"),
+            SMARTQQ_JSON_FIELD(DiscussMessage, time, "time"),
+            SMARTQQ_JSON_FIELD(DiscussMessage, uid, "send_uin"),
+            SMARTQQ_JSON_FIELD(DiscussMessage, msgId, "msg_id"),
+            SMARTQQ_JSON_FIELD(DiscussMessage, msgId2, "msg_id2"),
+            SMARTQQ_JSON_FIELD(DiscussMessage, msgType, "msg_type"),
+            SMARTQQ_JSON_READER("content", &readMessageContent<DiscussMessage>),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
@@ -191,16 +657,19 @@ struct Friend {
 };
 
 struct FriendStatus {
-    int64_t uin;
+    int64_t uin = 0;
     string status;
-    int clientType;
+    int clientType = 0;
 
     FriendStatus() {}
 
-    FriendStatus(nlohmann::json json) {
-        uin = json["uin"];
-        status = json["status"];
-        clientType = json["client_type"];
+    FriendStatus(const nlohmann::json& json) {
+        static constexpr JsonField<FriendStatus> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(FriendStatus, uin, "uin"),
+            SMARTQQ_JSON_FIELD(FriendStatus, status, "status"),
+            SMARTQQ_JSON_FIELD(FriendStatus, clientType, "client_type"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
@@ -208,135 +677,197 @@ struct GroupUser {
     string nick;
     string province;
     string gender;
-    int64_t uin;
+    int64_t uin = 0;
     string country;
     string city;
     string card;
-    int clientType;
-    int status;
-    bool vip;
-    int vipLevel;
+    int clientType = 0;
+    int status = 0;
+    bool vip = false;
+    int vipLevel = 0;
 
     GroupUser() {}
 
-    GroupUser(nlohmann::json json) {
-        nick = json["nick"];
-        province = json["province"];
-        gender = json["gender"];
-        uin = json["uin"];
-        country = json["country"];
-        city = json["city"];
-        /*
-         *card = json["card"];
-         *clientType = json["client_type"];
-         *status = json["status"];
-         *vip = json["vip"];
-         *vipLevel = json["vipLevel"];
-         */
+    // An entry of minfo, the other arrays of the group info fill in the rest
+    GroupUser(const nlohmann::json& json) {
+        static constexpr JsonField<GroupUser> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(GroupUser, nick, "nick"),
+            SMARTQQ_JSON_FIELD(GroupUser, province, "province"),
+            SMARTQQ_JSON_FIELD(GroupUser, gender, "gender"),
+            SMARTQQ_JSON_FIELD(GroupUser, uin, "uin"),
+            SMARTQQ_JSON_FIELD(GroupUser, country, "country"),
+            SMARTQQ_JSON_FIELD(GroupUser, city, "city"),
+        };
+        readJsonFields(*this, json, FIELDS);
+    }
+
+    // An entry of stats, keyed by uin
+    void readStat(const nlohmann::json& json) {
+        static constexpr JsonField<GroupUser> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(GroupUser, clientType, "client_type"),
+            SMARTQQ_JSON_FIELD(GroupUser, status, "stat"),
+        };
+        readJsonFields(*this, json, FIELDS);
+    }
+
+    // An entry of cards, keyed by muin
+    void readCard(const nlohmann::json& json) {
+        static constexpr JsonField<GroupUser> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(GroupUser, card, "card"),
+        };
+        readJsonFields(*this, json, FIELDS);
+    }
+
+    // An entry of vipinfo, keyed by u
+    void readVip(const nlohmann::json& json) {
+        static constexpr JsonField<GroupUser> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(GroupUser, vip, "is_vip"),
+            SMARTQQ_JSON_FIELD(GroupUser, vipLevel, "vip_level"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
 struct GroupInfo {
-    int64_t gid;
-    int64_t createtime;
+    int64_t gid = 0;
+    int64_t createtime = 0;
     string memo;
     string name;
-    int64_t owner;
+    int64_t owner = 0;
     string markname;
     list<GroupUser> users;
 
     GroupInfo() {}
 
-    GroupInfo(nlohmann::json json) {
-        gid = json["gid"];
-        createtime = json["createtime"];
-        memo = json["memo"];
-        name = json["name"];
-        owner = json["owner"];
+    GroupInfo(const nlohmann::json& json) {
+        static constexpr JsonField<GroupInfo> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(GroupInfo, gid, "gid"),
+            SMARTQQ_JSON_FIELD(GroupInfo, createtime, "createtime"),
+            SMARTQQ_JSON_FIELD(GroupInfo, memo, "memo"),
+            SMARTQQ_JSON_FIELD(GroupInfo, name, "name"),
+            SMARTQQ_JSON_FIELD(GroupInfo, owner, "owner"),
+            SMARTQQ_JSON_FIELD(GroupInfo, markname, "markname"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
 struct Group {
-    int64_t id;
+    int64_t id = 0;
     string name;
-    int64_t flag;
-    int64_t code;
+    int64_t flag = 0;
+    int64_t code = 0;
 
     GroupInfo ginfo;
 
     static Group parseJson(const nlohmann::json& json) {
+        static constexpr JsonField<Group> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Group, id, "gid"),
+            SMARTQQ_JSON_FIELD(Group, name, "name"),
+            SMARTQQ_JSON_FIELD(Group, flag, "flag"),
+            SMARTQQ_JSON_FIELD(Group, code, "code"),
+        };
         Group g;
-        g.id = json["gid"].get<int64_t>();
-        g.name = json["name"].get<string>();
-        g.flag = json["flag"].get<int64_t>();
-        g.code = json["code"].get<int64_t>();
+        readJsonFields(g, json, FIELDS);
         return g;
     }
 };
 
 struct GroupMessage {
-    int64_t gid;
-    int64_t time;
-    string content;
-    int64_t uid;
-    Font font;
+    int64_t gid = 0;
+    int64_t time = 0;
+    MessageContent content;
+    int64_t uid = 0;
+    FontRef font;
+    // Given by the server, 0 if missing. poll2 may deliver a message twice.
+    int64_t msgId = 0;
+    int64_t msgId2 = 0;
+    int msgType = 0;
 
     GroupMessage() {}
 
-    GroupMessage(nlohmann::json json) {
-        time = json["time"].get<int64_t>();
-        gid = json["group_code"].get<int64_t>();
-        uid = json["send_uin"].get<int64_t>();
-        auto _content = json["content"].get<list<nlohmann::json>>();
-        font = Font(_content.front().
-                get<list<nlohmann::json>>().back());
-        auto msg = _content.back();
-        if(msg.is_array()) {
-            // ["face", 10]
-            auto _face = msg.get<vector<nlohmann::json>>();
-            content = string("/").append(_face.front().get<string>())
-                .append("#")
-                .append(std::to_string(_face.back().get<int>()));
-            // "/face#10"
-        } else content = msg.get<string>();
+    GroupMessage(const nlohmann::json& json) {
+        static constexpr JsonField<GroupMessage> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(GroupMessage, gid, "group_code"),
+            SMARTQQ_JSON_FIELD(GroupMessage, time, "time"),
+            SMARTQQ_JSON_FIELD(GroupMessage, uid, "send_uin"),
+            SMARTQQ_JSON_FIELD(GroupMessage, msgId, "msg_id"),
+            SMARTQQ_JSON_FIELD(GroupMessage, msgId2, "msg_id2"),
+            SMARTQQ_JSON_FIELD(GroupMessage, msgType, "msg_type"),
+            SMARTQQ_JSON_READER("content", &readMessageContent<GroupMessage>),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
 struct Message {
-    int64_t time;
-    string content;
-    int64_t uid;
-    Font font;
+    int64_t time = 0;
+    MessageContent content;
+    int64_t uid = 0;
+    FontRef font;
+    // Given by the server, 0 if missing. poll2 may deliver a message twice.
+    int64_t msgId = 0;
+    int64_t msgId2 = 0;
+    int msgType = 0;
 
     Message() {}
-    Message(nlohmann::json json) {
-        time = json["time"].get<int64_t>();
-        uid = json["from_uin"].get<int64_t>();
-        auto _content = json["content"].get<list<nlohmann::json>>();
-        font = Font(_content.front().
-                get<list<nlohmann::json>>().back());
-        auto msg = _content.back();
-        if(msg.is_array()) {
-            // ["face", 10]
-            auto _face = msg.get<vector<nlohmann::json>>();
-            content = string("/").append(_face.front().get<string>())
-                .append("#")
-                .append(std::to_string(_face.back().get<int>()));
-            // "/face#10"
-        } else content = msg.get<string>();
+    Message(const nlohmann::json& json) {
+        static constexpr JsonField<Message> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Message, time, "time"),
+            SMARTQQ_JSON_FIELD(Message, uid, "from_uin"),
+            SMARTQQ_JSON_FIELD(Message, msgId, "msg_id"),
+            SMARTQQ_JSON_FIELD(Message, msgId2, "msg_id2"),
+            SMARTQQ_JSON_FIELD(Message, msgType, "msg_type"),
+            SMARTQQ_JSON_READER("content", &readMessageContent<Message>),
+        };
+        readJsonFields(*this, json, FIELDS);
+    }
+};
+
+/* One message of a poll2 result, as queued for the plugins. Only the member
+ * matching type is filled. */
+struct MessageEvent {
+    enum Type { FRIEND_MESSAGE, GROUP_MESSAGE, DISCUSS_MESSAGE, TYPE_COUNT };
+
+    // Holds the arena the content borrows from, if any
+    MessageArenaRef arena;
+    Type type;
+    Message message;
+    GroupMessage groupMessage;
+    DiscussMessage discussMessage;
+
+    MessageEvent() : type(FRIEND_MESSAGE) {}
+
+    // A copy owns its content, so it leaves the arena alone and may outlive
+    // MessageArenaPool
+    MessageEvent(const MessageEvent& other) : type(other.type), message(other.message),
+        groupMessage(other.groupMessage), discussMessage(other.discussMessage) {}
+
+    MessageEvent(MessageEvent&& other) = default;
+
+    MessageEvent& operator=(const MessageEvent& other) {
+        if (this != &other) {
+            *this = MessageEvent(other);
+        }
+        return *this;
     }
+
+    MessageEvent& operator=(MessageEvent&& other) = default;
 };
 
 struct Recent {
-    int64_t uin;
+    int64_t uin = 0;
     // 0:Friend, 1:Group, 2:Discuss
-    int type;
+    int type = 0;
 
     Recent() {}
 
-    Recent(nlohmann::json json) {
-        uin = json["uin"];
-        type = json["type"];
+    Recent(const nlohmann::json& json) {
+        static constexpr JsonField<Recent> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(Recent, uin, "uin"),
+            SMARTQQ_JSON_FIELD(Recent, type, "type"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
@@ -345,44 +876,47 @@ struct UserInfo {
     string phone;
     string occupation;
     string college;
-    int64_t uin;
-    int blood;
+    int64_t uin = 0;
+    int blood = 0;
     string lnick;
     string homepage;
-    bool vipInfo;
+    bool vipInfo = false;
     string city;
     string country;
     string province;
     string personal;
-    int shengxiao;
+    int shengxiao = 0;
     string nick;
     string email;
-    int64_t account;
+    int64_t account = 0;
     string gender;
     string mobile;
 
     UserInfo() {}
 
-    UserInfo(nlohmann::json json) {
-        birthday = json["birthday"];
-        phone = json["phone"];
-        occupation = json["occupation"];
-        college = json["college"];
-        uin = json["uin"];
-        blood = json["blood"];
-        lnick = json["lnick"];
-        homepage = json["homepage"];
-        vipInfo = json["vip_info"].get<int>() == 1?true:false;
-        city = json["city"];
-        country = json["country"];
-        province = json["province"];
-        personal = json["personal"];
-        shengxiao = json["shengxiao"];
-        nick = json["nick"];
-        email = json["email"];
-        account = json["account"];
-        gender = json["gender"];
-        mobile = json["mobile"];
+    UserInfo(const nlohmann::json& json) {
+        static constexpr JsonField<UserInfo> FIELDS[] = {
+            SMARTQQ_JSON_FIELD(UserInfo, birthday, "birthday"),
+            SMARTQQ_JSON_FIELD(UserInfo, phone, "phone"),
+            SMARTQQ_JSON_FIELD(UserInfo, occupation, "occupation"),
+            SMARTQQ_JSON_FIELD(UserInfo, college, "college"),
+            SMARTQQ_JSON_FIELD(UserInfo, uin, "uin"),
+            SMARTQQ_JSON_FIELD(UserInfo, blood, "blood"),
+            SMARTQQ_JSON_FIELD(UserInfo, lnick, "lnick"),
+            SMARTQQ_JSON_FIELD(UserInfo, homepage, "homepage"),
+            SMARTQQ_JSON_FIELD(UserInfo, vipInfo, "vip_info"),
+            SMARTQQ_JSON_FIELD(UserInfo, city, "city"),
+            SMARTQQ_JSON_FIELD(UserInfo, country, "country"),
+            SMARTQQ_JSON_FIELD(UserInfo, province, "province"),
+            SMARTQQ_JSON_FIELD(UserInfo, personal, "personal"),
+            SMARTQQ_JSON_FIELD(UserInfo, shengxiao, "shengxiao"),
+            SMARTQQ_JSON_FIELD(UserInfo, nick, "nick"),
+            SMARTQQ_JSON_FIELD(UserInfo, email, "email"),
+            SMARTQQ_JSON_FIELD(UserInfo, account, "account"),
+            SMARTQQ_JSON_FIELD(UserInfo, gender, "gender"),
+            SMARTQQ_JSON_FIELD(UserInfo, mobile, "mobile"),
+        };
+        readJsonFields(*this, json, FIELDS);
     }
 };
 
@@ -0,0 +1,132 @@
+#ifndef __SMARTQQ_MSGQUEUE_H__
+#define __SMARTQQ_MSGQUEUE_H__
+
+#include "smartqq.hpp"
+#include "model.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Bounded ring buffer of MessageEvent between the poll thread, the only
+ * producer, and the dispatch thread. Cells carry a sequence number, so Push
+ * and Pop never take a lock, the mutex only parks a side that has to wait.
+ * Besides the consumer, the producer may pop too, to drop the oldest event.
+ *
+ * What a Push into a full queue does depends on the overflow policy:
+ *   BLOCK         wait until the consumer frees a cell
+ *   DROP_OLDEST   drop the oldest queued event to make room
+ *   DROP_BY_TYPE  drop the new event if its type is droppable, else BLOCK */
+class MessageQueue {
+public:
+    enum Overflow { BLOCK, DROP_OLDEST, DROP_BY_TYPE };
+
+    // Bits of MessageEvent::Type, group and discuss chatter by default
+    static const unsigned DEFAULT_DROPPABLE = (1u << MessageEvent::GROUP_MESSAGE)
+        | (1u << MessageEvent::DISCUSS_MESSAGE);
+
+    // capacity is rounded up to a power of two
+    MessageQueue(size_t capacity, Overflow overflow, unsigned droppable = DEFAULT_DROPPABLE);
+
+    MessageQueue(const MessageQueue&) = delete;
+
+    MessageQueue& operator=(const MessageQueue&) = delete;
+
+    // Producer only. False if event was dropped or the queue is closed.
+    // With more, events of the same batch follow and the consumer is only
+    // woken by the last, so it pops the batch in one go.
+    bool Push(MessageEvent&& event, bool more = false);
+
+    // Waits for an event, false once the queue is closed. Events still
+    // queued then are never popped.
+    bool Pop(MessageEvent& event);
+
+    bool TryPop(MessageEvent& event);
+
+    // Wakes both sides, Push and Pop fail from now on
+    void Close();
+
+    // Empties and reopens a closed queue. Neither side may be running.
+    void Reset();
+
+    size_t GetCapacity() const {
+        return mask_ + 1;
+    }
+
+    Overflow GetOverflow() const {
+        return overflow_;
+    }
+
+    // Approximate while both sides run
+    size_t GetDepth() const;
+
+    // Highest depth seen after a Push
+    size_t GetMaxDepth() const {
+        return maxDepth_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t GetPushed() const {
+        return pushed_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t GetDropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // Pushes that had to wait for a free cell
+    uint64_t GetBlocked() const {
+        return blocked_.load(std::memory_order_relaxed);
+    }
+
+    // One line: capacity, depth, max depth, pushed, dropped, blocked
+    void Dump(std::ostream& out) const;
+
+private:
+    struct Cell {
+        std::atomic<uint64_t> seq;
+        MessageEvent event;
+    };
+
+    bool IsClosed() const {
+        return closed_.load(std::memory_order_acquire);
+    }
+
+    // Parks until ready() or Close(), ready is checked under mutex_
+    template <typename Ready>
+    void Wait(Ready ready);
+
+    void Wake();
+
+    static const size_t CACHE_LINE = 64;
+
+    const size_t mask_;
+    const Overflow overflow_;
+    const unsigned droppable_;
+    std::unique_ptr<Cell[]> cells_;
+
+    // Padded apart, so the two sides don't share a cache line
+    char padHead_[CACHE_LINE];
+    std::atomic<uint64_t> head_;
+    char padTail_[CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+    std::atomic<uint64_t> tail_;
+    char padEnd_[CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+
+    std::atomic<bool> closed_;
+    std::atomic<int> sleepers_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+
+    std::atomic<size_t> maxDepth_;
+    std::atomic<uint64_t> pushed_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> blocked_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -0,0 +1,273 @@
+#ifndef __SMARTQQ_OUTBOUND_H__
+#define __SMARTQQ_OUTBOUND_H__
+
+#include "smartqq.hpp"
+#include "sendpayload.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Allows rate sends per second on average and burst of them at once. Not
+ * thread-safe, SendScheduler guards its buckets. */
+class TokenBucket {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    TokenBucket(double rate, double burst);
+
+    // Takes a token if one is there at now
+    bool TryTake(Clock::time_point now);
+
+    // How long from now until a token is there, zero if one is
+    Clock::duration WaitTime(Clock::time_point now);
+
+    // Back to burst tokens by now, nothing to remember
+    bool IsFull(Clock::time_point now);
+
+    // New rate and burst from now on, the tokens earned so far are kept
+    void SetLimit(double rate, double burst, Clock::time_point now);
+
+private:
+    void Refill(Clock::time_point now);
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_;
+};
+
+struct SendLimit {
+    // Sends per second, 0 for no limit, and how many may go at once after
+    // a quiet spell
+    double rate;
+    double burst;
+};
+
+/* Outbound rates. A send needs a token from the bucket of its target, one
+ * bucket per friend, group or discuss, and one from the global bucket. */
+struct SendLimits {
+    SendLimit perFriend = {1.0, 2.0};
+    SendLimit perGroup = {1.0, 2.0};
+    SendLimit perDiscuss = {1.0, 2.0};
+    SendLimit global = {3.0, 5.0};
+};
+
+/* Merging of the messages queued for one target into one send. The first
+ * message of a target waits up to window for others to join it, then as
+ * many as fit in maxLength bytes go out together, separator between them.
+ * Only messages of one priority are merged, and interactive ones never wait
+ * for others. Off while maxLength is 0. */
+struct SendCoalescing {
+    int64_t windowMillis = 0;
+    size_t maxLength = 0;
+    std::string separator = "\n";
+};
+
+// Classes of outbound traffic, most urgent first
+enum SendPriority { SEND_INTERACTIVE, SEND_NORMAL, SEND_BULK, SEND_PRIORITIES };
+
+/* How the priorities share the rate. Strictly, a ready message of a more
+ * urgent class always goes first. Weighted, the classes with a ready message
+ * take turns, each as often as its weight says.
+ *
+ * A class with a maxWaitMillis is shed once its messages would wait longer:
+ * those queued for longer age out, and while the messages of it and the more
+ * urgent classes need more of the global rate than maxWaitMillis gives, its
+ * newest are shed, newcomers refused. Capacity stays a hard bound on top,
+ * reaching it sheds the least urgent messages for more urgent ones. */
+struct SendPriorities {
+    bool weighted = false;
+    unsigned weights[SEND_PRIORITIES] = {16, 4, 1};
+    // 0 for no limit
+    int64_t maxWaitMillis[SEND_PRIORITIES] = {0, 60000, 30000};
+};
+
+struct OutboundMessage {
+    SendPayload::Target target;
+    int64_t id;
+    std::string text;
+};
+
+// Result of a send, the retcode or errCode of the server if it answered
+const int SEND_OK = 0;
+const int SEND_FAILED = -1;
+const int SEND_DROPPED = -2;
+
+// Told how the send of one queued message ended, once
+typedef std::function<void(int result)> SendCallback;
+
+/* Queues the messages plugins send and hands them to the sender on a thread
+ * of its own, as fast as the token buckets of SendLimits allow. The sender
+ * doesn't wait for the answer, so sends to different targets overlap, but a
+ * target has one send in flight at a time and its messages of one priority
+ * go out in order. The priority to send next is
+ * picked by SendPriorities, then among the targets whose bucket has a token
+ * the one with the oldest waiting message of it goes first, so a chatty
+ * target can't hold up the others. Enqueue is thread-safe and never
+ * blocks. */
+class SendScheduler {
+public:
+    // Starts posting one message, called on the scheduler thread only. Must
+    // not throw, and must call done with the result exactly once, from any
+    // thread, at once or when the answer comes.
+    typedef std::function<void(const OutboundMessage&, SendCallback done)> Sender;
+
+    static const size_t DEFAULT_CAPACITY = 1024;
+
+    SendScheduler(Sender sender, size_t capacity = DEFAULT_CAPACITY);
+
+    // Drops what is still queued, once the sends in flight are done. Their
+    // callbacks get SEND_DROPPED.
+    ~SendScheduler();
+
+    SendScheduler(const SendScheduler&) = delete;
+
+    SendScheduler& operator=(const SendScheduler&) = delete;
+
+    // False, and the message is dropped, if the global rate can't send it
+    // within the maxWaitMillis of priority, or if capacity messages are
+    // queued and none of a less urgent class can be shed to make room. Else
+    // done, if set, is called once it is sent, merged or not, or shed.
+    bool Enqueue(SendPayload::Target target, int64_t id, std::string text,
+            SendCallback done = nullptr, SendPriority priority = SEND_NORMAL);
+
+    // Applies to the global bucket and those of every target at once
+    void SetLimits(const SendLimits& limits);
+
+    void SetCoalescing(const SendCoalescing& coalescing);
+
+    void SetPriorities(const SendPriorities& priorities);
+
+    size_t GetDepth() const;
+
+    size_t GetDepth(SendPriority priority) const;
+
+    uint64_t GetSent() const {
+        return sent_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t GetDropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    // Queued messages dropped for more urgent ones
+    uint64_t GetShed() const {
+        return shed_.load(std::memory_order_relaxed);
+    }
+
+    // Times the thread had messages queued but none it could send yet
+    uint64_t GetThrottled() const {
+        return throttled_.load(std::memory_order_relaxed);
+    }
+
+    // Messages that went out as part of an earlier one's send
+    uint64_t GetCoalesced() const {
+        return coalesced_.load(std::memory_order_relaxed);
+    }
+
+    // One line: depth of each priority, targets, sent, dropped, shed,
+    // throttled, coalesced
+    void Dump(std::ostream& out) const;
+
+private:
+    typedef std::pair<int, int64_t> TargetKey;
+
+    struct Queued {
+        OutboundMessage message;
+        SendCallback done;
+        // Of Enqueue, orders the targets
+        uint64_t seq;
+        TokenBucket::Clock::time_point queued;
+    };
+
+    struct TargetQueue {
+        // Shared by every priority
+        TokenBucket bucket;
+        std::deque<Queued> pending[SEND_PRIORITIES];
+        // Sent and not answered yet, the next one waits for it
+        bool inFlight;
+
+        explicit TargetQueue(const SendLimit& limit) : bucket(limit.rate, limit.burst),
+            inFlight(false) {}
+
+        bool IsEmpty() const;
+    };
+
+    void Run();
+
+    // Completion of the send to key, calls done with result
+    void Finished(const TargetKey& key, const std::vector<SendCallback>& done, int result);
+
+    // Of the priorities with a target in ready, the one to send next
+    int PickPriority(TargetQueue* const ready[SEND_PRIORITIES]);
+
+    // How long from now the head of pending may wait for others to join it
+    TokenBucket::Clock::duration CoalesceWait(const std::deque<Queued>& pending,
+            int priority, TokenBucket::Clock::time_point now) const;
+
+    // Pops the head of pending into message, and with it whichever messages
+    // after it fit, their callbacks into done
+    void TakeNext(std::deque<Queued>& pending, int priority, OutboundMessage& message,
+            std::vector<SendCallback>& done);
+
+    // Pops the newest message of the least urgent class below priority into
+    // shed, false if nothing is queued below priority
+    bool Shed(int priority, Queued& shed);
+
+    // Pops the newest message of priority, one must be queued
+    void PopNewest(int priority, Queued& shed);
+
+    // How many messages of priority and more urgent ones the global rate
+    // sends within its maxWaitMillis, SIZE_MAX for no limit
+    size_t WaitBudget(int priority) const;
+
+    // Moves the messages past the maxWaitMillis of their class into shed,
+    // as SendPriorities describes
+    void ShedLate(TokenBucket::Clock::time_point now, std::vector<Queued>& shed);
+
+    const SendLimit& LimitOf(SendPayload::Target target) const;
+
+    const Sender sender_;
+    const size_t capacity_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    SendLimits limits_;
+    SendCoalescing coalescing_;
+    SendPriorities priorities_;
+    // Smooth weighted round robin state, one per priority
+    int64_t credits_[SEND_PRIORITIES];
+    TokenBucket global_;
+    std::map<TargetKey, TargetQueue> targets_;
+    size_t depth_;
+    size_t depths_[SEND_PRIORITIES];
+    size_t inFlight_;
+    uint64_t seq_;
+    bool closed_;
+
+    std::atomic<uint64_t> sent_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> shed_;
+    std::atomic<uint64_t> throttled_;
+    std::atomic<uint64_t> coalesced_;
+
+    // Started at the end of the constructor, once everything above is set
+    std::thread thread_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef __SMARTQQ_POLLDECODE_H__
+#define __SMARTQQ_POLLDECODE_H__
+
+#include "smartqq.hpp"
+#include "model.hpp"
+#include "jsonstream.hpp"
+#include "recentids.hpp"
+#include "arena.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Decodes a poll2 response body straight into MessageEvents, no json value
+ * is built on the way. Keys are matched in place and the fields of a message
+ * gathered in reused buffers, so the strings the events end up owning are
+ * the only allocations. Reuse one decoder for every poll. */
+class PollDecoder : private JsonHandler {
+public:
+    PollDecoder();
+
+    // Appends the messages of body to events, in order. Those recent already
+    // knows, or seen earlier in body, are left out. With arena, contents
+    // are borrowed from it and nothing is allocated per message once the
+    // buffers are warm. throw invalid_argument if body is malformed.
+    void Decode(const char* body, size_t length, std::vector<MessageEvent>& events,
+            const RecentIds* recent = nullptr, MessageArenaRef arena = MessageArenaRef());
+
+    // Keys of the messages the last Decode appended. Nothing is added to
+    // recent, the caller does that once it has accepted the poll, so a
+    // failed one is delivered again.
+    const std::vector<uint64_t>& GetKeys() const {
+        return keys_;
+    }
+
+    bool HasRetcode() const {
+        return hasRetcode_;
+    }
+
+    int GetRetcode() const {
+        return retcode_;
+    }
+
+    // Messages of a poll that are told apart from each other, and keys_
+    // holds without growing
+    static const size_t BATCH_MESSAGES = 256;
+
+private:
+    // What the innermost open container is
+    enum Context { SKIP, ROOT, RESULT, ELEMENT, VALUE, CONTENT, SEGMENT, FONT, STYLE };
+
+    // Keys the schema cares about
+    enum Field {
+        OTHER, RETCODE, RESULT_KEY, POLL_TYPE, VALUE_KEY, CONTENT_KEY, FROM_UIN,
+        SEND_UIN, GROUP_CODE, DID, MSG_ID, MSG_ID2, MSG_TYPE, TIME, COLOR, NAME,
+        SIZE, STYLE_KEY
+    };
+
+    void onNull();
+    void onBool(bool value);
+    void onInteger(int64_t value);
+    void onFloat(double value);
+    void onString(const std::string& value);
+    void onKey(const std::string& key);
+    void onStartObject();
+    void onEndObject();
+    void onStartArray();
+    void onEndArray();
+
+    Context Top() const {
+        return stack_.empty() ? SKIP : stack_.back();
+    }
+
+    void Open(Context context);
+
+    void BeginMessage();
+
+    void EndMessage();
+
+    // Moves content_ into content, or copies it to the arena
+    void TakeContent(MessageContent& content);
+
+    JsonStreamParser parser_;
+    std::vector<Context> stack_;
+    // Key of the value coming next
+    Field field_;
+
+    bool hasRetcode_;
+    int retcode_;
+
+    std::vector<MessageEvent>* events_;
+    const RecentIds* recent_;
+    std::vector<uint64_t> keys_;
+    // keys_ again, to find copies within the body in O(1)
+    BatchIds batch_;
+    MessageArenaRef arena_;
+
+    // The message being decoded
+    std::string pollType_;
+    int64_t time_;
+    int64_t fromUin_;
+    int64_t sendUin_;
+    int64_t groupCode_;
+    int64_t did_;
+    int64_t msgId_;
+    int64_t msgId2_;
+    int msgType_;
+    MessageContent content_;
+    Font font_;
+    int styleIndex_;
+    // Of the content segment being decoded, like ["face", 10]
+    int segmentItems_;
+    std::string segmentName_;
+    int64_t segmentNumber_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
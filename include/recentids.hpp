@@ -0,0 +1,104 @@
+#ifndef __SMARTQQ_RECENTIDS_H__
+#define __SMARTQQ_RECENTIDS_H__
+
+#include "smartqq.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* The last capacity message keys seen, in fixed memory. A ring keeps them in
+ * arrival order and an open addressing table, at most half full, finds
+ * them. Insert evicts the oldest key once the ring is full, so nothing is
+ * allocated after construction. Not thread-safe. */
+class RecentIds {
+public:
+    // capacity is rounded up to a power of two
+    explicit RecentIds(size_t capacity);
+
+    RecentIds(const RecentIds&) = delete;
+
+    RecentIds& operator=(const RecentIds&) = delete;
+
+    // True if key is among the recent ones, else remembers it
+    bool CheckAndInsert(uint64_t key);
+
+    bool Contains(uint64_t key) const;
+
+    void Clear();
+
+    // Key of a poll2 message of type, by its sender, ids and time
+    static uint64_t MessageKey(int type, uint64_t fromUin, uint64_t msgId,
+            uint64_t msgId2, uint64_t time);
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    size_t GetCapacity() const {
+        return ringMask_ + 1;
+    }
+
+private:
+    // Marks a free slot, keys equal to it are stored as EMPTY_ALIAS
+    static const uint64_t EMPTY = 0;
+    static const uint64_t EMPTY_ALIAS = 1;
+
+    size_t HomeOf(uint64_t key) const {
+        return (size_t)(key ^ (key >> 32)) & slotMask_;
+    }
+
+    // Slot of key, or of the free slot ending its probe sequence
+    size_t Probe(uint64_t key) const;
+
+    void Erase(uint64_t key);
+
+    const size_t ringMask_;
+    const size_t slotMask_;
+    std::unique_ptr<uint64_t[]> ring_;
+    std::unique_ptr<uint64_t[]> slots_;
+    uint64_t next_;
+    size_t size_;
+};
+
+/* Keys of the messages in one poll, to catch a message sent twice in the
+ * same response. An open addressing table like RecentIds, but its slots are
+ * stamped with the batch they belong to, so Reset is O(1) and there is no
+ * eviction. Past capacity keys the rest go unremembered. Not thread-safe. */
+class BatchIds {
+public:
+    // capacity is rounded up to a power of two
+    explicit BatchIds(size_t capacity);
+
+    BatchIds(const BatchIds&) = delete;
+
+    BatchIds& operator=(const BatchIds&) = delete;
+
+    // True if key was inserted since the last Reset, else remembers it
+    bool CheckAndInsert(uint64_t key);
+
+    // Forgets every key, for the next batch
+    void Reset();
+
+    size_t GetSize() const {
+        return size_;
+    }
+
+    size_t GetCapacity() const {
+        return (slotMask_ + 1) / 2;
+    }
+
+private:
+    const size_t slotMask_;
+    std::unique_ptr<uint64_t[]> slots_;
+    // Batch of each slot, those not equal to batch_ are free
+    std::unique_ptr<uint32_t[]> batches_;
+    uint32_t batch_;
+    size_t size_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -9,6 +9,7 @@
 #include <list>
 #include <map>
 #include <memory>
+#include <future>
 
 NAMESPACE_BEGIN(smartqq)
 
@@ -21,6 +22,8 @@ public:
     void onMessage(const Message& message);
     void onGroupMessage(const GroupMessage& message);
     void onDiscussMessage(const DiscussMessage& message);
+    // Hands the whole batch to one plugin after another
+    void onMessages(const MessageEvent* events, size_t count);
 private:
     std::vector<std::shared_ptr<RobotPlugin>>& plugins_;
 };
@@ -84,8 +87,14 @@ public:
 
         robot_.groups_ = robot_.client_.getGroupList();
 
+        // Fan out all the info requests before waiting on any of them
+        std::vector<std::future<GroupInfo>> ginfos;
         for (auto& i : robot_.groups_) {
-            i.ginfo = robot_.client_.getGroupInfo(i.code);
+            ginfos.push_back(robot_.client_.getGroupInfoAsync(i.code));
+        }
+        auto ginfo = ginfos.begin();
+        for (auto& i : robot_.groups_) {
+            i.ginfo = (ginfo ++)->get();
         }
 
     }
@@ -93,8 +102,13 @@ public:
     void UpdateDiscussList() const {
         robot_.discusses_ = robot_.client_.getDiscussList();
 
+        std::vector<std::future<DiscussInfo>> dinfos;
+        for (auto& i : robot_.discusses_) {
+            dinfos.push_back(robot_.client_.getDiscussInfoAsync(i.id));
+        }
+        auto dinfo = dinfos.begin();
         for (auto& i : robot_.discusses_) {
-            i.dinfo = robot_.client_.getDiscussInfo(i.id);
+            i.dinfo = (dinfo ++)->get();
         }
 
     }
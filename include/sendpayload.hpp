@@ -0,0 +1,47 @@
+#ifndef __SMARTQQ_SENDPAYLOAD_H__
+#define __SMARTQQ_SENDPAYLOAD_H__
+
+#include "smartqq.hpp"
+
+#include <cstdint>
+#include <string>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* Form body of send_buddy_msg2, send_qun_msg2 and send_discu_msg2, that is
+ * r= and the url-encoded json of the message, whose content is itself json
+ * in a string. Everything but the text, the target and the msg_id is the
+ * same for every send, so it is encoded once per session and spliced in,
+ * and the text goes through its three escapings in a single pass. */
+class SendPayload {
+public:
+    enum Target { FRIEND, GROUP, DISCUSS };
+
+    SendPayload();
+
+    // Encodes the fragments every send shares, call it after login. font is
+    // Font::toString() of the font messages are sent in
+    void SetSession(int64_t clientId, const std::string& psessionid,
+            const std::string& font);
+
+    // Appends the body sending msg to id to out, which may be a buffer kept
+    // around to reuse its capacity
+    void Build(Target target, int64_t id, const std::string& msg, int64_t msgId,
+            std::string& out) const;
+
+    std::string Build(Target target, int64_t id, const std::string& msg,
+            int64_t msgId) const;
+
+    // json escapes text twice, then url-encodes it, straight into out
+    static void AppendText(const std::string& text, std::string& out);
+
+private:
+    // r= and the json up to where the text starts
+    std::string head_;
+    // From after the text up to the target key, both constant
+    std::string tail_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef __SMARTQQ_STATS_H__
+#define __SMARTQQ_STATS_H__
+
+#include "smartqq.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* HDR-style histogram: values below 8 get a bucket each, every power of two
+ * above is split into 8 linear sub-buckets, so a percentile is off by less
+ * than 12.5%. Record is lock-free and safe from any thread. */
+class Histogram {
+public:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    Histogram();
+
+    void Record(uint64_t value);
+
+    uint64_t Count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Sum() const {
+        return sum_.load(std::memory_order_relaxed);
+    }
+
+    uint64_t Max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the p-th percentile, p in [0, 100]
+    uint64_t Percentile(double p) const;
+
+    void Reset();
+
+private:
+    static int BucketOf(uint64_t value);
+
+    static uint64_t UpperBoundOf(int bucket);
+
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+/* Outcome and cost of the requests to one endpoint. Latencies are in
+ * microseconds. */
+struct EndpointStats {
+    // Index 0 counts transport errors, 1 to 5 count 1xx to 5xx
+    static const int STATUS_BUCKETS = 6;
+
+    enum Retcode {
+        RETCODE_OK,
+        RETCODE_100,
+        RETCODE_102,
+        RETCODE_103,
+        RETCODE_116,
+        RETCODE_121,
+        RETCODE_OTHER,
+        // No retcode at all or a body that isn't json
+        RETCODE_INVALID,
+        RETCODE_BUCKETS
+    };
+
+    EndpointStats();
+
+    // Called when the transfer finishes, status_code 0 means transport error
+    void RecordTransfer(long status_code, uint64_t micros, uint64_t in, uint64_t out);
+
+    // A transfer dropped before it finished, a transport error with no latency
+    void RecordAbort();
+
+    void RecordParse(uint64_t micros);
+
+    void RecordRetcode(int retcode);
+
+    void RecordInvalid();
+
+    void Reset();
+
+    // One line: count, latency and parse percentiles, bytes, statuses, retcodes
+    void Dump(std::ostream& out) const;
+
+    Histogram latency;
+    Histogram parse;
+    std::atomic<uint64_t> bytesIn;
+    std::atomic<uint64_t> bytesOut;
+    std::atomic<uint64_t> status[STATUS_BUCKETS];
+    std::atomic<uint64_t> retcodes[RETCODE_BUCKETS];
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef __SMARTQQ_TRAFFIC_H__
+#define __SMARTQQ_TRAFFIC_H__
+
+#include "smartqq.hpp"
+#include "api.hpp"
+#include "http.hpp"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <cpr/cpr.h>
+
+NAMESPACE_BEGIN(smartqq)
+
+/* One request/response pair of a traffic log. Times are in microseconds,
+ * start is relative to the beginning of the recording. */
+struct TrafficRecord {
+    ApiId id;
+    HttpRequest::Method method;
+    int64_t start;
+    int64_t duration;
+    std::string url;
+    std::string requestBody;
+    long status;
+    cpr::ErrorCode error;
+    std::string responseBody;
+};
+
+/* Appends every finished request to a binary log:
+ *   "SQTR" u32 version, then per record
+ *   u16 id, u8 method, i64 start, i64 duration, i32 status, i32 error,
+ *   str url, str request body, str response body
+ * where str is a u32 length and the bytes. Integers are in host byte order.
+ * Cookies are left out, a replay never sends anything anywhere.
+ * Records are flushed as they are written, so a killed process keeps them. */
+class TrafficRecorder {
+public:
+    explicit TrafficRecorder(const std::string& path);
+
+    ~TrafficRecorder();
+
+    TrafficRecorder(const TrafficRecorder&) = delete;
+
+    TrafficRecorder& operator=(const TrafficRecorder&) = delete;
+
+    // Returns the callback to submit request with instead of done. It records
+    // the pair, then calls done. A body sink of request is teed for the log.
+    HttpCallback Wrap(ApiId id, HttpRequest& request, HttpCallback done);
+
+    void Record(const TrafficRecord& record);
+
+    // Microseconds since the recorder was created
+    int64_t Now() const;
+
+private:
+    std::FILE* file_;
+    std::mutex mutex_;
+    std::chrono::steady_clock::time_point begin_;
+};
+
+/* Serves the responses of a traffic log in place of the http engine. Every
+ * endpoint replays its own records in order, whatever the request says.
+ * At recorded speed a response is held back until the time it arrived at
+ * while recording, counted from the first request of the replay, otherwise
+ * it is answered at once. Callbacks run on the replay thread. */
+class TrafficReplayer {
+public:
+    enum Speed { RECORDED, FAST };
+
+    TrafficReplayer(const std::string& path, Speed speed);
+
+    ~TrafficReplayer();
+
+    TrafficReplayer(const TrafficReplayer&) = delete;
+
+    TrafficReplayer& operator=(const TrafficReplayer&) = delete;
+
+    // An endpoint out of records answers with an error
+    void Submit(ApiId id, HttpRequest request, HttpCallback callback);
+
+    // Raise flag and fail every request carrying it at once, as
+    // HttpEngine::Cancel, whenever its record would be due
+    void Cancel(const std::shared_ptr<std::atomic<bool>>& flag);
+
+    // Records not replayed yet, of all endpoints
+    size_t GetRemaining();
+
+private:
+    struct Pending {
+        std::chrono::steady_clock::time_point due;
+        uint64_t seq;
+        HttpRequest request;
+        HttpCallback callback;
+        cpr::Response response;
+
+        bool operator<(const Pending& other) const {
+            return due != other.due ? due > other.due : seq > other.seq;
+        }
+    };
+
+    void Loop();
+
+    void Deliver(Pending& pending);
+
+    // Pops the pending requests whose cancel flag is up into cancelled
+    void TakeCancelled(std::vector<Pending>& cancelled);
+
+    // Answers a cancelled request like HttpEngine does
+    static void Abort(Pending& pending);
+
+    Speed speed_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool running_;
+    bool started_;
+    // A Cancel came since the loop last looked
+    bool cancelled_;
+    std::chrono::steady_clock::time_point begin_;
+    std::deque<TrafficRecord> records_[API_COUNT];
+    std::priority_queue<Pending> pending_;
+    uint64_t seq_;
+
+    std::thread thread_;
+};
+
+NAMESPACE_END(smartqq)
+
+#endif
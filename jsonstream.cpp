@@ -0,0 +1,434 @@
+#include "jsonstream.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+
+using namespace smartqq;
+using json = nlohmann::json;
+
+static bool isNumberChar(char c)
+{
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.'
+        || c == 'e' || c == 'E';
+}
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+JsonStreamParser::JsonStreamParser(JsonHandler& handler) : handler_(handler)
+{
+    Reset();
+}
+
+void JsonStreamParser::Reset()
+{
+    state_ = VALUE;
+    lexeme_ = NONE;
+    key_ = false;
+    stack_.clear();
+    token_.clear();
+    unicode_ = 0;
+    unicodeDigits_ = 0;
+    highSurrogate_ = 0;
+    offset_ = 0;
+}
+
+void JsonStreamParser::Feed(const char* data, size_t length)
+{
+    for (size_t i = 0; i < length; i ++) {
+        char c = data[i];
+
+        switch (lexeme_) {
+            case STRING:
+                if (c == '"') {
+                    lexeme_ = NONE;
+                    EmitString();
+                } else if (c == '\\') {
+                    lexeme_ = ESCAPE;
+                } else if ((unsigned char)c < 0x20) {
+                    Error("control character in string");
+                } else {
+                    // Copy the whole run of plain characters at once
+                    FlushSurrogate();
+                    size_t j = i + 1;
+                    while (j < length && data[j] != '"' && data[j] != '\\'
+                            && (unsigned char)data[j] >= 0x20) {
+                        j ++;
+                    }
+                    token_.append(data + i, j - i);
+                    i = j - 1;
+                }
+                continue;
+            case ESCAPE:
+                lexeme_ = STRING;
+                if (c != 'u') FlushSurrogate();
+                switch (c) {
+                    case '"': token_.push_back('"'); break;
+                    case '\\': token_.push_back('\\'); break;
+                    case '/': token_.push_back('/'); break;
+                    case 'b': token_.push_back('\b'); break;
+                    case 'f': token_.push_back('\f'); break;
+                    case 'n': token_.push_back('\n'); break;
+                    case 'r': token_.push_back('\r'); break;
+                    case 't': token_.push_back('\t'); break;
+                    case 'u':
+                        lexeme_ = UNICODE;
+                        unicode_ = 0;
+                        unicodeDigits_ = 0;
+                        break;
+                    default:
+                        Error("invalid escape");
+                }
+                continue;
+            case UNICODE:
+                {
+                    int v = hexValue(c);
+                    if (v < 0) Error("invalid unicode escape");
+                    unicode_ = unicode_ << 4 | v;
+                    if (++ unicodeDigits_ == 4) {
+                        lexeme_ = STRING;
+                        AppendCodePoint(unicode_);
+                    }
+                }
+                continue;
+            case NUMBER:
+                if (isNumberChar(c)) {
+                    token_.push_back(c);
+                    continue;
+                }
+                lexeme_ = NONE;
+                EmitNumber();
+                break;
+            case LITERAL:
+                if (c >= 'a' && c <= 'z') {
+                    token_.push_back(c);
+                    continue;
+                }
+                lexeme_ = NONE;
+                EmitLiteral();
+                break;
+            case NONE:
+                break;
+        }
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            continue;
+        }
+
+        switch (state_) {
+            case FIRST_VALUE_OR_END:
+                if (c == ']') {
+                    EndContainer(c);
+                    break;
+                }
+                // Fall through
+            case VALUE:
+                BeginValue(c);
+                break;
+            case FIRST_KEY_OR_END:
+                if (c == '}') {
+                    EndContainer(c);
+                    break;
+                }
+                // Fall through
+            case KEY:
+                if (c != '"') Error("expect a key");
+                lexeme_ = STRING;
+                key_ = true;
+                token_.clear();
+                break;
+            case COLON:
+                if (c != ':') Error("expect ':'");
+                state_ = VALUE;
+                break;
+            case AFTER_VALUE:
+                if (c == ',') {
+                    state_ = stack_.back() == '{' ? KEY : VALUE;
+                } else {
+                    EndContainer(c);
+                }
+                break;
+            case DONE:
+                Error("trailing characters");
+        }
+    }
+    offset_ += length;
+}
+
+void JsonStreamParser::Finish()
+{
+    if (lexeme_ == NUMBER) {
+        lexeme_ = NONE;
+        EmitNumber();
+    } else if (lexeme_ == LITERAL) {
+        lexeme_ = NONE;
+        EmitLiteral();
+    }
+    if (state_ != DONE) {
+        Error("unexpected end of input");
+    }
+}
+
+void JsonStreamParser::BeginValue(char c)
+{
+    switch (c) {
+        case '{':
+            stack_.push_back('{');
+            state_ = FIRST_KEY_OR_END;
+            handler_.onStartObject();
+            break;
+        case '[':
+            stack_.push_back('[');
+            state_ = FIRST_VALUE_OR_END;
+            handler_.onStartArray();
+            break;
+        case '"':
+            lexeme_ = STRING;
+            key_ = false;
+            token_.clear();
+            break;
+        case 't':
+        case 'f':
+        case 'n':
+            lexeme_ = LITERAL;
+            token_.assign(1, c);
+            break;
+        default:
+            if (c == '-' || (c >= '0' && c <= '9')) {
+                lexeme_ = NUMBER;
+                token_.assign(1, c);
+            } else {
+                Error("expect a value");
+            }
+    }
+}
+
+void JsonStreamParser::EndValue()
+{
+    state_ = stack_.empty() ? DONE : AFTER_VALUE;
+}
+
+void JsonStreamParser::EndContainer(char c)
+{
+    if (stack_.empty()) Error("unbalanced brackets");
+    char open = stack_.back();
+    if ((open == '{' && c != '}') || (open == '[' && c != ']')) {
+        Error("unbalanced brackets");
+    }
+    stack_.pop_back();
+    if (open == '{') {
+        handler_.onEndObject();
+    } else {
+        handler_.onEndArray();
+    }
+    EndValue();
+}
+
+void JsonStreamParser::EmitString()
+{
+    FlushSurrogate();
+    if (key_) {
+        key_ = false;
+        state_ = COLON;
+        handler_.onKey(token_);
+    } else {
+        handler_.onString(token_);
+        EndValue();
+    }
+}
+
+void JsonStreamParser::EmitNumber()
+{
+    const char* begin = token_.c_str();
+    char* end = nullptr;
+    bool integer = token_.find_first_of(".eE") == std::string::npos;
+    if (integer) {
+        errno = 0;
+        long long value = std::strtoll(begin, &end, 10);
+        if (end == begin + token_.length() && errno != ERANGE) {
+            handler_.onInteger(value);
+            EndValue();
+            return;
+        }
+    }
+    double value = std::strtod(begin, &end);
+    if (end != begin + token_.length()) Error("invalid number");
+    handler_.onFloat(value);
+    EndValue();
+}
+
+void JsonStreamParser::EmitLiteral()
+{
+    if (token_ == "true") {
+        handler_.onBool(true);
+    } else if (token_ == "false") {
+        handler_.onBool(false);
+    } else if (token_ == "null") {
+        handler_.onNull();
+    } else {
+        Error("invalid literal");
+    }
+    EndValue();
+}
+
+void JsonStreamParser::AppendCodePoint(uint32_t cp)
+{
+    if (cp >= 0xD800 && cp <= 0xDBFF) {
+        FlushSurrogate();
+        highSurrogate_ = cp;
+        return;
+    }
+    if (cp >= 0xDC00 && cp <= 0xDFFF) {
+        if (highSurrogate_ == 0) {
+            cp = 0xFFFD;
+        } else {
+            cp = 0x10000 + ((highSurrogate_ - 0xD800) << 10) + (cp - 0xDC00);
+            highSurrogate_ = 0;
+        }
+    } else {
+        FlushSurrogate();
+    }
+
+    if (cp < 0x80) {
+        token_.push_back((char)cp);
+    } else if (cp < 0x800) {
+        token_.push_back((char)(0xC0 | cp >> 6));
+        token_.push_back((char)(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        token_.push_back((char)(0xE0 | cp >> 12));
+        token_.push_back((char)(0x80 | (cp >> 6 & 0x3F)));
+        token_.push_back((char)(0x80 | (cp & 0x3F)));
+    } else {
+        token_.push_back((char)(0xF0 | cp >> 18));
+        token_.push_back((char)(0x80 | (cp >> 12 & 0x3F)));
+        token_.push_back((char)(0x80 | (cp >> 6 & 0x3F)));
+        token_.push_back((char)(0x80 | (cp & 0x3F)));
+    }
+}
+
+void JsonStreamParser::FlushSurrogate()
+{
+    // A lone high surrogate becomes U+FFFD
+    if (highSurrogate_ != 0) {
+        highSurrogate_ = 0;
+        token_.append("\xEF\xBF\xBD");
+    }
+}
+
+void JsonStreamParser::Error(const char* what) const
+{
+    throw std::invalid_argument(std::string("Invalid json in the chunk at byte ")
+            .append(std::to_string(offset_)).append(": ").append(what));
+}
+
+JsonResultHandler::JsonResultHandler() : hasRetcode(false), retcode(0),
+    hasErrCode(false), errCode(0), hasResult(false), depth_(0) {}
+
+void JsonResultHandler::onNull()
+{
+    onScalar(json());
+}
+
+void JsonResultHandler::onBool(bool value)
+{
+    onScalar(json(value));
+}
+
+void JsonResultHandler::onInteger(int64_t value)
+{
+    if (stack_.empty() && depth_ == 1) {
+        if (member_ == "retcode") {
+            hasRetcode = true;
+            retcode = (int)value;
+        } else if (member_ == "errCode") {
+            hasErrCode = true;
+            errCode = (int)value;
+        }
+    }
+    onScalar(json(value));
+}
+
+void JsonResultHandler::onFloat(double value)
+{
+    onScalar(json(value));
+}
+
+void JsonResultHandler::onString(const std::string& value)
+{
+    onScalar(json(value));
+}
+
+void JsonResultHandler::onKey(const std::string& key)
+{
+    if (!stack_.empty()) {
+        key_ = key;
+    } else if (depth_ == 1) {
+        member_ = key;
+    }
+}
+
+void JsonResultHandler::onStartObject()
+{
+    onStartContainer(json::object());
+}
+
+void JsonResultHandler::onEndObject()
+{
+    onEndContainer();
+}
+
+void JsonResultHandler::onStartArray()
+{
+    onStartContainer(json::array());
+}
+
+void JsonResultHandler::onEndArray()
+{
+    onEndContainer();
+}
+
+void JsonResultHandler::onStartContainer(json&& init)
+{
+    depth_ ++;
+    if (!stack_.empty()) {
+        stack_.push_back(&insert(std::move(init)));
+    } else if (depth_ == 2 && member_ == "result") {
+        hasResult = true;
+        result = std::move(init);
+        stack_.push_back(&result);
+    }
+}
+
+void JsonResultHandler::onEndContainer()
+{
+    if (!stack_.empty()) {
+        stack_.pop_back();
+    }
+    depth_ --;
+}
+
+void JsonResultHandler::onScalar(json&& value)
+{
+    if (!stack_.empty()) {
+        insert(std::move(value));
+    } else if (depth_ == 1 && member_ == "result") {
+        hasResult = true;
+        result = std::move(value);
+    }
+}
+
+json& JsonResultHandler::insert(json&& value)
+{
+    json& top = *stack_.back();
+    if (top.is_array()) {
+        top.push_back(std::move(value));
+        return top.back();
+    }
+    return top[key_] = std::move(value);
+}
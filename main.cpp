@@ -6,11 +6,32 @@
 
 #include <iostream>
 #include <memory>
+#include <cstdlib>
 using namespace std;
 
 int main(int argc, char *argv[])
 {
     smartqq::SmartQQClient c;
+    // e.g. http://127.0.0.1:8080 for tools/stub_server
+    const char* baseUrl = getenv("SMARTQQ_BASE_URL");
+    if (baseUrl != nullptr) {
+        c.setBaseUrl(baseUrl);
+    }
+    // Capture traffic to a log, or run offline from one
+    const char* record = getenv("SMARTQQ_RECORD");
+    if (record != nullptr) {
+        c.recordTraffic(record);
+    }
+    const char* replay = getenv("SMARTQQ_REPLAY");
+    if (replay != nullptr) {
+        const char* speed = getenv("SMARTQQ_REPLAY_SPEED");
+        c.replayTraffic(replay, speed != nullptr && string(speed) == "fast" ?
+                smartqq::TrafficReplayer::FAST : smartqq::TrafficReplayer::RECORDED);
+    }
+    // Keep two poll2 requests outstanding
+    if (getenv("SMARTQQ_DOUBLE_POLL") != nullptr) {
+        c.setDoublePolling(true);
+    }
     smartqq::Robot r(c);
     shared_ptr<smartqq::RobotPlugin> d(new smartqq::BotDice(r));
     shared_ptr<smartqq::TuringBot> t(new smartqq::TuringBot(r));
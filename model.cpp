@@ -3,3 +3,126 @@ using namespace smartqq;
 
 const Font Font::DEFAULT_FONT = defaultFont();
 
+FontTable& FontTable::instance()
+{
+    static FontTable table;
+    return table;
+}
+
+FontTable::FontTable() : count_(0)
+{
+    for (uint32_t i = 0; i < SLOTS; i ++) {
+        slots_[i].store(0, std::memory_order_relaxed);
+    }
+    intern(Font::defaultFont());
+}
+
+FontTable::Key::Key(const Font& font) : color(&font.color), name(&font.name),
+    size(font.size), style{font.style[0], font.style[1], font.style[2]}
+{
+}
+
+FontTable::Key::Key(const nlohmann::json& json) : size(0), style{0, 0, 0}
+{
+    static const string EMPTY;
+    color = name = &EMPTY;
+    // As Font(json) reads them
+    auto members = json.get_ptr<const nlohmann::json::object_t*>();
+    if (members == nullptr) return;
+    for (auto& member : *members) {
+        const string& key = member.first;
+        const nlohmann::json& value = member.second;
+        if (key == "color" && value.is_string()) {
+            color = value.get_ptr<const string*>();
+        } else if (key == "name" && value.is_string()) {
+            name = value.get_ptr<const string*>();
+        } else if (key == "size") {
+            readJsonValue(size, value);
+        } else if (key == "style") {
+            readJsonValue(style, value);
+        }
+    }
+}
+
+uint64_t FontTable::hashOf(const Key& key)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    auto mix = [&h](const char* data, size_t length) {
+        for (size_t i = 0; i < length; i ++) {
+            h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+        }
+    };
+    mix(key.color->data(), key.color->length());
+    mix(key.name->data(), key.name->length());
+    int numbers[4] = {key.size, key.style[0], key.style[1], key.style[2]};
+    mix((const char*)numbers, sizeof(numbers));
+    return h;
+}
+
+bool FontTable::matches(const Font& font, const Key& key)
+{
+    return font.size == key.size && font.style[0] == key.style[0]
+        && font.style[1] == key.style[1] && font.style[2] == key.style[2]
+        && font.color == *key.color && font.name == *key.name;
+}
+
+uint32_t FontTable::probe(const Key& key, uint64_t hash) const
+{
+    uint32_t slot = (uint32_t)(hash % SLOTS);
+    while (true) {
+        uint32_t id = slots_[slot].load(std::memory_order_acquire);
+        if (id == 0 || matches(entries_[id - 1]->font, key)) {
+            return slot;
+        }
+        slot = (slot + 1) % SLOTS;
+    }
+}
+
+uint32_t FontTable::intern(const Key& key)
+{
+    uint64_t h = hashOf(key);
+    uint32_t slot = probe(key, h);
+    uint32_t found = slots_[slot].load(std::memory_order_acquire);
+    if (found != 0) {
+        return found - 1;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Another thread may have added it, or something else in the slot
+    slot = probe(key, h);
+    found = slots_[slot].load(std::memory_order_relaxed);
+    if (found != 0) {
+        return found - 1;
+    }
+    uint32_t id = count_.load(std::memory_order_relaxed);
+    if (id == MAX_FONTS) {
+        return DEFAULT_ID;
+    }
+    Font font;
+    font.color = *key.color;
+    font.name = *key.name;
+    font.size = key.size;
+    memcpy(font.style, key.style, sizeof(font.style));
+    entries_[id].reset(new Entry{font, font.toString()});
+    // Publishes the entry to get() and to lookups on other threads
+    count_.store(id + 1, std::memory_order_release);
+    slots_[slot].store(id + 1, std::memory_order_release);
+    return id;
+}
+
+const Font& FontTable::get(uint32_t id) const
+{
+    if (id >= count_.load(std::memory_order_acquire)) {
+        id = DEFAULT_ID;
+    }
+    return entries_[id]->font;
+}
+
+const string& FontTable::toString(uint32_t id) const
+{
+    if (id >= count_.load(std::memory_order_acquire)) {
+        id = DEFAULT_ID;
+    }
+    return entries_[id]->json;
+}
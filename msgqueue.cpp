@@ -0,0 +1,176 @@
+#include "msgqueue.hpp"
+
+#include <thread>
+
+using namespace smartqq;
+
+static size_t roundUpToPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+MessageQueue::MessageQueue(size_t capacity, Overflow overflow, unsigned droppable) :
+    mask_(roundUpToPowerOfTwo(capacity == 0 ? 1 : capacity) - 1),
+    overflow_(overflow), droppable_(droppable),
+    cells_(new Cell[mask_ + 1]),
+    head_(0), tail_(0), closed_(false), sleepers_(0),
+    maxDepth_(0), pushed_(0), dropped_(0), blocked_(0)
+{
+    // A cell is free for the push at position seq, and holds the event of
+    // position seq - 1 once it is pushed
+    for (size_t i = 0; i <= mask_; i ++) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool MessageQueue::Push(MessageEvent&& event, bool more)
+{
+    bool waited = false;
+    while (!IsClosed()) {
+        uint64_t pos = tail_.load(std::memory_order_relaxed);
+        Cell& cell = cells_[pos & mask_];
+        if (cell.seq.load(std::memory_order_acquire) == pos) {
+            cell.event = std::move(event);
+            cell.seq.store(pos + 1, std::memory_order_release);
+            tail_.store(pos + 1, std::memory_order_release);
+
+            size_t depth = (size_t)(pos + 1 - head_.load(std::memory_order_relaxed));
+            if (depth > maxDepth_.load(std::memory_order_relaxed)) {
+                maxDepth_.store(depth, std::memory_order_relaxed);
+            }
+            pushed_.fetch_add(1, std::memory_order_relaxed);
+            if (!more) {
+                Wake();
+            }
+            return true;
+        }
+
+        // Full, or the consumer is still moving the oldest event out. It
+        // may sleep on a batch not woken for yet.
+        Wake();
+        if (overflow_ == DROP_BY_TYPE && (droppable_ & (1u << event.type)) != 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (overflow_ == DROP_OLDEST) {
+            MessageEvent oldest;
+            if (TryPop(oldest)) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                std::this_thread::yield();
+            }
+            continue;
+        }
+        if (!waited) {
+            waited = true;
+            blocked_.fetch_add(1, std::memory_order_relaxed);
+        }
+        Wait([this, pos, &cell] {
+            return cell.seq.load(std::memory_order_acquire) == pos;
+        });
+    }
+    return false;
+}
+
+bool MessageQueue::Pop(MessageEvent& event)
+{
+    while (!IsClosed()) {
+        if (TryPop(event)) {
+            return true;
+        }
+        Wait([this] {
+            uint64_t pos = head_.load(std::memory_order_relaxed);
+            return cells_[pos & mask_].seq.load(std::memory_order_acquire) == pos + 1;
+        });
+    }
+    return false;
+}
+
+bool MessageQueue::TryPop(MessageEvent& event)
+{
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells_[pos & mask_];
+        int64_t diff = (int64_t)(cell->seq.load(std::memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+            // The producer dropping the oldest may race us for this one
+            if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+    event = std::move(cell->event);
+    cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+    Wake();
+    return true;
+}
+
+template <typename Ready>
+void MessageQueue::Wait(Ready ready)
+{
+    sleepers_.fetch_add(1);
+    // Pairs with the fence in Wake(): either we see the new state below or
+    // the other side sees a sleeper and notifies
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this, &ready] {
+            return IsClosed() || ready();
+        });
+    }
+    sleepers_.fetch_sub(1);
+}
+
+void MessageQueue::Wake()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) != 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_all();
+    }
+}
+
+void MessageQueue::Close()
+{
+    closed_.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(mutex_);
+    cond_.notify_all();
+}
+
+void MessageQueue::Reset()
+{
+    for (size_t i = 0; i <= mask_; i ++) {
+        cells_[i].event = MessageEvent();
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+    head_.store(0, std::memory_order_relaxed);
+    tail_.store(0, std::memory_order_relaxed);
+    closed_.store(false, std::memory_order_release);
+}
+
+size_t MessageQueue::GetDepth() const
+{
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    return tail > head ? (size_t)(tail - head) : 0;
+}
+
+void MessageQueue::Dump(std::ostream& out) const
+{
+    static const char* const OVERFLOW_NAMES[] = { "block", "drop-oldest", "drop-by-type" };
+
+    out << "capacity=" << GetCapacity()
+        << " overflow=" << OVERFLOW_NAMES[overflow_]
+        << " depth=" << GetDepth()
+        << " max=" << GetMaxDepth()
+        << " pushed=" << GetPushed()
+        << " dropped=" << GetDropped()
+        << " blocked=" << GetBlocked();
+}
@@ -0,0 +1,494 @@
+#include "outbound.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+using namespace smartqq;
+
+TokenBucket::TokenBucket(double rate, double burst) : rate_(rate),
+    burst_(burst < 1 ? 1 : burst), tokens_(burst_), last_(Clock::now())
+{
+}
+
+void TokenBucket::Refill(Clock::time_point now)
+{
+    if (now <= last_) return;
+    std::chrono::duration<double> elapsed = now - last_;
+    tokens_ += elapsed.count() * rate_;
+    if (tokens_ > burst_) {
+        tokens_ = burst_;
+    }
+    last_ = now;
+}
+
+bool TokenBucket::TryTake(Clock::time_point now)
+{
+    if (rate_ <= 0) return true;
+    Refill(now);
+    if (tokens_ < 1) return false;
+    tokens_ -= 1;
+    return true;
+}
+
+TokenBucket::Clock::duration TokenBucket::WaitTime(Clock::time_point now)
+{
+    if (rate_ <= 0) return Clock::duration::zero();
+    Refill(now);
+    if (tokens_ >= 1) return Clock::duration::zero();
+    std::chrono::duration<double> wait((1 - tokens_) / rate_);
+    // Rounded up, so a wakeup after it always finds the token
+    return std::chrono::duration_cast<Clock::duration>(wait) + Clock::duration(1);
+}
+
+bool TokenBucket::IsFull(Clock::time_point now)
+{
+    if (rate_ <= 0) return true;
+    Refill(now);
+    return tokens_ >= burst_;
+}
+
+void TokenBucket::SetLimit(double rate, double burst, Clock::time_point now)
+{
+    // Earned at the old rate up to now. An unlimited bucket never took a
+    // token, it starts full.
+    bool unlimited = rate_ <= 0;
+    Refill(now);
+    rate_ = rate;
+    burst_ = burst < 1 ? 1 : burst;
+    if (unlimited || tokens_ > burst_) {
+        tokens_ = burst_;
+    }
+}
+
+SendScheduler::SendScheduler(Sender sender, size_t capacity) : sender_(std::move(sender)),
+    capacity_(capacity), global_(limits_.global.rate, limits_.global.burst),
+    depth_(0), inFlight_(0), seq_(0), closed_(false), sent_(0), dropped_(0), shed_(0), throttled_(0),
+    coalesced_(0)
+{
+    for (int i = 0; i < SEND_PRIORITIES; i ++) {
+        credits_[i] = 0;
+        depths_[i] = 0;
+    }
+    thread_ = std::thread(&SendScheduler::Run, this);
+}
+
+SendScheduler::~SendScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    cond_.notify_all();
+    thread_.join();
+    {
+        // Their callbacks still refer to this
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return inFlight_ == 0; });
+    }
+    for (auto& target : targets_) {
+        for (auto& pending : target.second.pending) {
+            for (auto& queued : pending) {
+                if (queued.done) {
+                    queued.done(SEND_DROPPED);
+                }
+            }
+        }
+    }
+}
+
+bool SendScheduler::TargetQueue::IsEmpty() const
+{
+    for (auto& queue : pending) {
+        if (!queue.empty()) return false;
+    }
+    return true;
+}
+
+bool SendScheduler::Enqueue(SendPayload::Target target, int64_t id, std::string text,
+        SendCallback done, SendPriority priority)
+{
+    std::vector<Queued> shed;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        size_t ahead = 0;
+        for (int i = 0; i <= priority; i ++) {
+            ahead += depths_[i];
+        }
+        if (ahead >= WaitBudget(priority)) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (depth_ >= capacity_) {
+            Queued queued;
+            if (!Shed(priority, queued)) {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            shed.push_back(std::move(queued));
+        }
+        TargetKey key(target, id);
+        auto it = targets_.find(key);
+        if (it == targets_.end()) {
+            it = targets_.emplace(key, TargetQueue(LimitOf(target))).first;
+        }
+        auto now = TokenBucket::Clock::now();
+        it->second.pending[priority].push_back(Queued{
+                OutboundMessage{target, id, std::move(text)},
+                std::move(done), seq_ ++, now});
+        depth_ ++;
+        depths_[priority] ++;
+        // It is ahead of the less urgent classes
+        ShedLate(now, shed);
+    }
+    cond_.notify_one();
+    for (auto& queued : shed) {
+        if (queued.done) {
+            queued.done(SEND_DROPPED);
+        }
+    }
+    return true;
+}
+
+bool SendScheduler::Shed(int priority, Queued& shed)
+{
+    for (int i = SEND_PRIORITIES - 1; i > priority; i --) {
+        if (depths_[i] == 0) continue;
+        PopNewest(i, shed);
+        return true;
+    }
+    return false;
+}
+
+void SendScheduler::PopNewest(int priority, Queued& shed)
+{
+    std::deque<Queued>* newest = nullptr;
+    for (auto& target : targets_) {
+        auto& pending = target.second.pending[priority];
+        if (!pending.empty() && (newest == nullptr || pending.back().seq > newest->back().seq)) {
+            newest = &pending;
+        }
+    }
+    shed = std::move(newest->back());
+    newest->pop_back();
+    depth_ --;
+    depths_[priority] --;
+    shed_.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t SendScheduler::WaitBudget(int priority) const
+{
+    int64_t maxWait = priorities_.maxWaitMillis[priority];
+    if (maxWait <= 0 || limits_.global.rate <= 0) {
+        return SIZE_MAX;
+    }
+    // At least one, a message must get through an idle scheduler
+    size_t budget = (size_t)(limits_.global.rate * maxWait / 1000);
+    return budget > 0 ? budget : 1;
+}
+
+void SendScheduler::ShedLate(TokenBucket::Clock::time_point now, std::vector<Queued>& shed)
+{
+    for (int i = SEND_PRIORITIES - 1; i >= 0; i --) {
+        int64_t maxWait = priorities_.maxWaitMillis[i];
+        if (maxWait <= 0 || depths_[i] == 0) continue;
+
+        // Aged out, the oldest of each target are in front
+        auto deadline = now - std::chrono::milliseconds(maxWait);
+        for (auto& target : targets_) {
+            auto& pending = target.second.pending[i];
+            while (!pending.empty() && pending.front().queued <= deadline) {
+                shed.push_back(std::move(pending.front()));
+                pending.pop_front();
+                depth_ --;
+                depths_[i] --;
+                shed_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Projected to wait too long behind the messages ahead of them
+        size_t ahead = 0;
+        for (int j = 0; j <= i; j ++) {
+            ahead += depths_[j];
+        }
+        size_t budget = WaitBudget(i);
+        while (ahead > budget && depths_[i] > 0) {
+            Queued queued;
+            PopNewest(i, queued);
+            shed.push_back(std::move(queued));
+            ahead --;
+        }
+    }
+}
+
+void SendScheduler::SetLimits(const SendLimits& limits)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        limits_ = limits;
+        auto now = TokenBucket::Clock::now();
+        global_.SetLimit(limits.global.rate, limits.global.burst, now);
+        for (auto& target : targets_) {
+            const SendLimit& limit = LimitOf((SendPayload::Target)target.first.first);
+            target.second.bucket.SetLimit(limit.rate, limit.burst, now);
+        }
+    }
+    // Waits computed at the old rates may be off now
+    cond_.notify_one();
+}
+
+void SendScheduler::SetCoalescing(const SendCoalescing& coalescing)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        coalescing_ = coalescing;
+    }
+    // Heads held back for the old window may be due now
+    cond_.notify_one();
+}
+
+void SendScheduler::SetPriorities(const SendPriorities& priorities)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        priorities_ = priorities;
+        for (auto& credit : credits_) {
+            credit = 0;
+        }
+    }
+    // Queued messages may be past the new limits
+    cond_.notify_one();
+}
+
+const SendLimit& SendScheduler::LimitOf(SendPayload::Target target) const
+{
+    switch (target) {
+    case SendPayload::GROUP:
+        return limits_.perGroup;
+    case SendPayload::DISCUSS:
+        return limits_.perDiscuss;
+    default:
+        return limits_.perFriend;
+    }
+}
+
+void SendScheduler::Run()
+{
+    OutboundMessage message;
+    std::vector<Queued> shed;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!closed_) {
+        if (depth_ == 0) {
+            cond_.wait(lock);
+            continue;
+        }
+
+        ShedLate(TokenBucket::Clock::now(), shed);
+        if (!shed.empty()) {
+            lock.unlock();
+            for (auto& queued : shed) {
+                if (queued.done) {
+                    queued.done(SEND_DROPPED);
+                }
+            }
+            shed.clear();
+            lock.lock();
+            continue;
+        }
+
+        // For each priority, the target whose bucket has a token, done
+        // coalescing and whose next message of it is the oldest, else how
+        // long until some target is ready
+        auto now = TokenBucket::Clock::now();
+        TargetQueue* ready[SEND_PRIORITIES] = {};
+        bool anyReady = false;
+        auto wait = TokenBucket::Clock::duration::max();
+        for (auto it = targets_.begin(); it != targets_.end(); ) {
+            TargetQueue& target = it->second;
+            if (target.inFlight) {
+                // Finished wakes the thread
+                ++ it;
+                continue;
+            }
+            if (target.IsEmpty()) {
+                // Idle and full again, a new bucket would be the same
+                if (target.bucket.IsFull(now)) {
+                    it = targets_.erase(it);
+                } else {
+                    ++ it;
+                }
+                continue;
+            }
+            auto bucketWait = target.bucket.WaitTime(now);
+            for (int i = 0; i < SEND_PRIORITIES; i ++) {
+                auto& pending = target.pending[i];
+                if (pending.empty()) continue;
+                auto targetWait = std::max(bucketWait, CoalesceWait(pending, i, now));
+                if (targetWait == TokenBucket::Clock::duration::zero()) {
+                    if (ready[i] == nullptr
+                            || pending.front().seq < ready[i]->pending[i].front().seq) {
+                        ready[i] = &target;
+                    }
+                    anyReady = true;
+                } else if (targetWait < wait) {
+                    wait = targetWait;
+                }
+            }
+            ++ it;
+        }
+        if (anyReady) {
+            wait = global_.WaitTime(now);
+        }
+        if (wait == TokenBucket::Clock::duration::max()) {
+            // Every target with messages has a send in flight
+            cond_.wait(lock);
+            continue;
+        }
+        if (!anyReady || wait != TokenBucket::Clock::duration::zero()) {
+            // An Enqueue wakes it early, its target may be ready
+            throttled_.fetch_add(1, std::memory_order_relaxed);
+            cond_.wait_for(lock, wait);
+            continue;
+        }
+
+        int priority = PickPriority(ready);
+        TargetQueue& target = *ready[priority];
+        global_.TryTake(now);
+        target.bucket.TryTake(now);
+        auto done = std::make_shared<std::vector<SendCallback>>();
+        TakeNext(target.pending[priority], priority, message, *done);
+        target.inFlight = true;
+        inFlight_ ++;
+        TargetKey key(message.target, message.id);
+
+        lock.unlock();
+        sender_(message, [this, key, done](int result) { Finished(key, *done, result); });
+        lock.lock();
+    }
+}
+
+void SendScheduler::Finished(const TargetKey& key, const std::vector<SendCallback>& done,
+        int result)
+{
+    sent_.fetch_add(1, std::memory_order_relaxed);
+    for (auto& callback : done) {
+        callback(result);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Kept in the map while in flight
+    targets_.find(key)->second.inFlight = false;
+    inFlight_ --;
+    // The thread and the destructor both wait on it. Under the lock, else
+    // the destructor may be done before it
+    cond_.notify_all();
+}
+
+int SendScheduler::PickPriority(TargetQueue* const ready[SEND_PRIORITIES])
+{
+    if (!priorities_.weighted) {
+        for (int i = 0; i < SEND_PRIORITIES; i ++) {
+            if (ready[i] != nullptr) return i;
+        }
+    }
+    // Every ready class earns its weight, the richest sends and pays the
+    // total, so over time each sends in proportion to its weight
+    int picked = -1;
+    int64_t total = 0;
+    for (int i = 0; i < SEND_PRIORITIES; i ++) {
+        if (ready[i] == nullptr) continue;
+        credits_[i] += priorities_.weights[i];
+        total += priorities_.weights[i];
+        if (picked < 0 || credits_[i] > credits_[picked]) {
+            picked = i;
+        }
+    }
+    credits_[picked] -= total;
+    return picked;
+}
+
+TokenBucket::Clock::duration SendScheduler::CoalesceWait(const std::deque<Queued>& pending,
+        int priority, TokenBucket::Clock::time_point now) const
+{
+    if (coalescing_.maxLength == 0 || priority == SEND_INTERACTIVE) {
+        return TokenBucket::Clock::duration::zero();
+    }
+    // Nothing more could join a full message
+    size_t length = 0;
+    for (auto& queued : pending) {
+        length += queued.message.text.size() + coalescing_.separator.size();
+        if (length >= coalescing_.maxLength) {
+            return TokenBucket::Clock::duration::zero();
+        }
+    }
+    auto due = pending.front().queued + std::chrono::milliseconds(coalescing_.windowMillis);
+    return due > now ? due - now : TokenBucket::Clock::duration::zero();
+}
+
+void SendScheduler::TakeNext(std::deque<Queued>& pending, int priority,
+        OutboundMessage& message, std::vector<SendCallback>& done)
+{
+    Queued& head = pending.front();
+    message = std::move(head.message);
+    if (head.done) {
+        done.push_back(std::move(head.done));
+    }
+    pending.pop_front();
+    depth_ --;
+    depths_[priority] --;
+
+    while (coalescing_.maxLength != 0 && !pending.empty()) {
+        Queued& queued = pending.front();
+        if (message.text.size() + coalescing_.separator.size()
+                + queued.message.text.size() > coalescing_.maxLength) {
+            break;
+        }
+        message.text.append(coalescing_.separator).append(queued.message.text);
+        if (queued.done) {
+            done.push_back(std::move(queued.done));
+        }
+        pending.pop_front();
+        depth_ --;
+        depths_[priority] --;
+        coalesced_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+size_t SendScheduler::GetDepth() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return depth_;
+}
+
+size_t SendScheduler::GetDepth(SendPriority priority) const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return depths_[priority];
+}
+
+void SendScheduler::Dump(std::ostream& out) const
+{
+    static const char* const PRIORITY_NAMES[] = { "interactive", "normal", "bulk" };
+
+    size_t depths[SEND_PRIORITIES];
+    size_t targets;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int i = 0; i < SEND_PRIORITIES; i ++) {
+            depths[i] = depths_[i];
+        }
+        targets = targets_.size();
+    }
+    for (int i = 0; i < SEND_PRIORITIES; i ++) {
+        out << PRIORITY_NAMES[i] << "=" << depths[i] << " ";
+    }
+    out << "targets=" << targets
+        << " sent=" << GetSent()
+        << " dropped=" << GetDropped()
+        << " shed=" << GetShed()
+        << " throttled=" << GetThrottled()
+        << " coalesced=" << GetCoalesced();
+}
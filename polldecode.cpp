@@ -0,0 +1,300 @@
+#include "polldecode.hpp"
+
+#include <cstring>
+
+using namespace smartqq;
+
+PollDecoder::PollDecoder() : parser_(*this), field_(OTHER), hasRetcode_(false),
+    retcode_(0), events_(nullptr), recent_(nullptr), batch_(BATCH_MESSAGES)
+{
+    keys_.reserve(BATCH_MESSAGES);
+    BeginMessage();
+}
+
+void PollDecoder::Decode(const char* body, size_t length, std::vector<MessageEvent>& events,
+        const RecentIds* recent, MessageArenaRef arena)
+{
+    parser_.Reset();
+    stack_.clear();
+    field_ = OTHER;
+    hasRetcode_ = false;
+    retcode_ = 0;
+    events_ = &events;
+    recent_ = recent;
+    keys_.clear();
+    batch_.Reset();
+    arena_ = std::move(arena);
+    try {
+        parser_.Feed(body, length);
+        parser_.Finish();
+    } catch (...) {
+        arena_ = MessageArenaRef();
+        throw;
+    }
+    events_ = nullptr;
+    recent_ = nullptr;
+    arena_ = MessageArenaRef();
+}
+
+void PollDecoder::BeginMessage()
+{
+    pollType_.clear();
+    time_ = fromUin_ = sendUin_ = groupCode_ = did_ = msgId_ = msgId2_ = 0;
+    msgType_ = 0;
+    content_.clear();
+    font_.color.clear();
+    font_.name.clear();
+    font_.size = 0;
+    memset(font_.style, 0, sizeof(font_.style));
+    styleIndex_ = 0;
+    segmentItems_ = 0;
+}
+
+void PollDecoder::EndMessage()
+{
+    MessageEvent::Type type;
+    if (pollType_ == "message") {
+        type = MessageEvent::FRIEND_MESSAGE;
+    } else if (pollType_ == "group_message") {
+        type = MessageEvent::GROUP_MESSAGE;
+    } else if (pollType_ == "discu_message") {
+        type = MessageEvent::DISCUSS_MESSAGE;
+    } else {
+        return;
+    }
+    // Without msg_id there is nothing to tell copies apart by
+    if (recent_ != nullptr && msgId_ != 0) {
+        uint64_t key = RecentIds::MessageKey(type, fromUin_, msgId_, msgId2_, time_);
+        if (recent_->Contains(key) || batch_.CheckAndInsert(key)) {
+            return;
+        }
+        keys_.push_back(key);
+    }
+
+    // Usually one of a handful, font_ keeps its buffers
+    FontRef font(font_);
+
+    events_->emplace_back();
+    MessageEvent& event = events_->back();
+    event.type = type;
+    event.arena = arena_;
+    switch (type) {
+    case MessageEvent::FRIEND_MESSAGE: {
+        Message& m = event.message;
+        m.time = time_;
+        m.uid = fromUin_;
+        m.msgId = msgId_;
+        m.msgId2 = msgId2_;
+        m.msgType = msgType_;
+        TakeContent(m.content);
+        m.font = font;
+        break;
+    }
+    case MessageEvent::GROUP_MESSAGE: {
+        GroupMessage& m = event.groupMessage;
+        m.time = time_;
+        m.gid = groupCode_;
+        m.uid = sendUin_;
+        m.msgId = msgId_;
+        m.msgId2 = msgId2_;
+        m.msgType = msgType_;
+        TakeContent(m.content);
+        m.font = font;
+        break;
+    }
+    default: {
+        DiscussMessage& m = event.discussMessage;
+        m.time = time_;
+        m.did = did_;
+        m.uid = sendUin_;
+        m.msgId = msgId_;
+        m.msgId2 = msgId2_;
+        m.msgType = msgType_;
+        TakeContent(m.content);
+        m.font = font;
+        break;
+    }
+    }
+}
+
+void PollDecoder::TakeContent(MessageContent& content)
+{
+    if (arena_) {
+        // content_ keeps its buffers for the next message
+        content = MessageContent(content_, *arena_);
+    } else {
+        content = std::move(content_);
+    }
+}
+
+void PollDecoder::Open(Context context)
+{
+    stack_.push_back(context);
+    field_ = OTHER;
+}
+
+void PollDecoder::onKey(const std::string& key)
+{
+    static const struct {
+        const char* name;
+        Field field;
+    } FIELDS[] = {
+        {"retcode", RETCODE}, {"result", RESULT_KEY}, {"poll_type", POLL_TYPE},
+        {"value", VALUE_KEY}, {"content", CONTENT_KEY}, {"from_uin", FROM_UIN},
+        {"send_uin", SEND_UIN}, {"group_code", GROUP_CODE}, {"did", DID},
+        {"msg_id", MSG_ID}, {"msg_id2", MSG_ID2}, {"msg_type", MSG_TYPE},
+        {"time", TIME}, {"color", COLOR}, {"name", NAME}, {"size", SIZE},
+        {"style", STYLE_KEY}
+    };
+
+    field_ = OTHER;
+    if (Top() == SKIP) {
+        return;
+    }
+    if (key.empty()) {
+        return;
+    }
+    for (const auto& f : FIELDS) {
+        if (key[0] == f.name[0] && key == f.name) {
+            field_ = f.field;
+            return;
+        }
+    }
+}
+
+void PollDecoder::onStartObject()
+{
+    Context parent = Top();
+    if (stack_.empty()) {
+        Open(ROOT);
+    } else if (parent == RESULT) {
+        BeginMessage();
+        Open(ELEMENT);
+    } else if (parent == ELEMENT && field_ == VALUE_KEY) {
+        Open(VALUE);
+    } else if (parent == SEGMENT && segmentName_ == "font") {
+        segmentItems_ ++;
+        Open(FONT);
+    } else {
+        if (parent == SEGMENT) segmentItems_ ++;
+        Open(SKIP);
+    }
+}
+
+void PollDecoder::onEndObject()
+{
+    Context context = Top();
+    stack_.pop_back();
+    field_ = OTHER;
+    if (context == ELEMENT) {
+        EndMessage();
+    }
+}
+
+void PollDecoder::onStartArray()
+{
+    Context parent = Top();
+    if (parent == ROOT && field_ == RESULT_KEY) {
+        Open(RESULT);
+    } else if (parent == VALUE && field_ == CONTENT_KEY) {
+        Open(CONTENT);
+    } else if (parent == CONTENT) {
+        segmentItems_ = 0;
+        segmentName_.clear();
+        segmentNumber_ = 0;
+        Open(SEGMENT);
+    } else if (parent == FONT && field_ == STYLE_KEY) {
+        styleIndex_ = 0;
+        Open(STYLE);
+    } else {
+        if (parent == SEGMENT) segmentItems_ ++;
+        Open(SKIP);
+    }
+}
+
+void PollDecoder::onEndArray()
+{
+    Context context = Top();
+    stack_.pop_back();
+    field_ = OTHER;
+    if (context == SEGMENT) {
+        if (segmentName_ == "face") {
+            content_.appendFace(segmentNumber_);
+        } else if (segmentName_ != "font" && !segmentName_.empty()) {
+            content_.appendOther(segmentName_.data(), segmentName_.length(), segmentNumber_);
+        }
+    }
+}
+
+void PollDecoder::onString(const std::string& value)
+{
+    switch (Top()) {
+    case ELEMENT:
+        if (field_ == POLL_TYPE) pollType_.assign(value);
+        break;
+    case CONTENT:
+        content_.appendText(value);
+        break;
+    case SEGMENT:
+        if (segmentItems_ ++ == 0) segmentName_.assign(value);
+        break;
+    case FONT:
+        if (field_ == COLOR) font_.color.assign(value);
+        else if (field_ == NAME) font_.name.assign(value);
+        break;
+    default:
+        break;
+    }
+}
+
+void PollDecoder::onInteger(int64_t value)
+{
+    switch (Top()) {
+    case ROOT:
+        if (field_ == RETCODE) {
+            hasRetcode_ = true;
+            retcode_ = (int)value;
+        }
+        break;
+    case VALUE:
+        switch (field_) {
+        case FROM_UIN: fromUin_ = value; break;
+        case SEND_UIN: sendUin_ = value; break;
+        case GROUP_CODE: groupCode_ = value; break;
+        case DID: did_ = value; break;
+        case MSG_ID: msgId_ = value; break;
+        case MSG_ID2: msgId2_ = value; break;
+        case MSG_TYPE: msgType_ = (int)value; break;
+        case TIME: time_ = value; break;
+        default: break;
+        }
+        break;
+    case SEGMENT:
+        segmentItems_ ++;
+        segmentNumber_ = value;
+        break;
+    case FONT:
+        if (field_ == SIZE) font_.size = (int)value;
+        break;
+    case STYLE:
+        if (styleIndex_ < 3) font_.style[styleIndex_ ++] = (int)value;
+        break;
+    default:
+        break;
+    }
+}
+
+void PollDecoder::onNull()
+{
+    if (Top() == SEGMENT) segmentItems_ ++;
+}
+
+void PollDecoder::onBool(bool)
+{
+    if (Top() == SEGMENT) segmentItems_ ++;
+}
+
+void PollDecoder::onFloat(double)
+{
+    if (Top() == SEGMENT) segmentItems_ ++;
+}
@@ -0,0 +1,146 @@
+#include "recentids.hpp"
+
+#include <initializer_list>
+
+using namespace smartqq;
+
+static size_t roundUpToPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+RecentIds::RecentIds(size_t capacity) :
+    ringMask_(roundUpToPowerOfTwo(capacity == 0 ? 1 : capacity) - 1),
+    slotMask_((ringMask_ + 1) * 2 - 1),
+    ring_(new uint64_t[ringMask_ + 1]),
+    slots_(new uint64_t[slotMask_ + 1])
+{
+    Clear();
+}
+
+size_t RecentIds::Probe(uint64_t key) const
+{
+    size_t i = HomeOf(key);
+    while (slots_[i] != EMPTY && slots_[i] != key) {
+        i = (i + 1) & slotMask_;
+    }
+    return i;
+}
+
+bool RecentIds::CheckAndInsert(uint64_t key)
+{
+    if (key == EMPTY) {
+        key = EMPTY_ALIAS;
+    }
+    size_t slot = Probe(key);
+    if (slots_[slot] == key) {
+        return true;
+    }
+
+    uint64_t& oldest = ring_[next_ & ringMask_];
+    if (size_ > ringMask_) {
+        Erase(oldest);
+        // The erase may have shifted a key into our slot
+        slot = Probe(key);
+    } else {
+        size_ ++;
+    }
+    oldest = key;
+    next_ ++;
+    slots_[slot] = key;
+    return false;
+}
+
+bool RecentIds::Contains(uint64_t key) const
+{
+    if (key == EMPTY) {
+        key = EMPTY_ALIAS;
+    }
+    return slots_[Probe(key)] == key;
+}
+
+void RecentIds::Erase(uint64_t key)
+{
+    size_t hole = Probe(key);
+    if (slots_[hole] != key) {
+        return;
+    }
+    // Backward shift: pull later keys of the run into the hole as long as
+    // that doesn't move them before their home slot
+    size_t i = hole;
+    while (true) {
+        i = (i + 1) & slotMask_;
+        if (slots_[i] == EMPTY) {
+            break;
+        }
+        size_t home = HomeOf(slots_[i]);
+        if (((i - home) & slotMask_) >= ((i - hole) & slotMask_)) {
+            slots_[hole] = slots_[i];
+            hole = i;
+        }
+    }
+    slots_[hole] = EMPTY;
+}
+
+uint64_t RecentIds::MessageKey(int type, uint64_t fromUin, uint64_t msgId,
+        uint64_t msgId2, uint64_t time)
+{
+    uint64_t key = (uint64_t)type + 1;
+    for (uint64_t v : {fromUin, msgId, msgId2, time}) {
+        key = (key ^ v) * 0x9E3779B97F4A7C15ULL;
+    }
+    return key;
+}
+
+void RecentIds::Clear()
+{
+    for (size_t i = 0; i <= ringMask_; i ++) {
+        ring_[i] = EMPTY;
+    }
+    for (size_t i = 0; i <= slotMask_; i ++) {
+        slots_[i] = EMPTY;
+    }
+    next_ = 0;
+    size_ = 0;
+}
+
+BatchIds::BatchIds(size_t capacity) :
+    slotMask_(roundUpToPowerOfTwo(capacity == 0 ? 1 : capacity) * 2 - 1),
+    slots_(new uint64_t[slotMask_ + 1]),
+    batches_(new uint32_t[slotMask_ + 1]()),
+    batch_(1),
+    size_(0)
+{
+}
+
+bool BatchIds::CheckAndInsert(uint64_t key)
+{
+    size_t i = (size_t)(key ^ (key >> 32)) & slotMask_;
+    while (batches_[i] == batch_) {
+        if (slots_[i] == key) {
+            return true;
+        }
+        i = (i + 1) & slotMask_;
+    }
+    // Keep the table at most half full
+    if (size_ < GetCapacity()) {
+        slots_[i] = key;
+        batches_[i] = batch_;
+        size_ ++;
+    }
+    return false;
+}
+
+void BatchIds::Reset()
+{
+    size_ = 0;
+    if (++ batch_ == 0) {
+        // Wrapped, stamps of 4 billion batches ago would look current
+        for (size_t i = 0; i <= slotMask_; i ++) {
+            batches_[i] = 0;
+        }
+        batch_ = 1;
+    }
+}
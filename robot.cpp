@@ -108,6 +108,13 @@ void SuperCallback::onDiscussMessage(const DiscussMessage &message)
     }
 }
 
+void SuperCallback::onMessages(const MessageEvent* events, size_t count)
+{
+    for (auto& p : plugins_) {
+        p->onMessages(events, count);
+    }
+}
+
 Robot::Robot(SmartQQClient& client) : client_(client),
     callback_(plugins)
 {
@@ -132,15 +139,25 @@ void Robot::Run()
 
     categories_ = client_.getFriendListWithCategory(friendMap_);
     groups_ = client_.getGroupList();
+    discusses_ = client_.getDiscussList();
 
+    // Issue every info request up front, they share the http engine
+    std::vector<std::future<GroupInfo>> ginfos;
     for (auto& i : groups_) {
-        i.ginfo = client_.getGroupInfo(i.code);
+        ginfos.push_back(client_.getGroupInfoAsync(i.code));
+    }
+    std::vector<std::future<DiscussInfo>> dinfos;
+    for (auto& i : discusses_) {
+        dinfos.push_back(client_.getDiscussInfoAsync(i.id));
     }
 
-    discusses_ = client_.getDiscussList();
-
+    auto ginfo = ginfos.begin();
+    for (auto& i : groups_) {
+        i.ginfo = (ginfo ++)->get();
+    }
+    auto dinfo = dinfos.begin();
     for (auto& i : discusses_) {
-        i.dinfo = client_.getDiscussInfo(i.id);
+        i.dinfo = (dinfo ++)->get();
     }
 
     client_.startPolling(callback_);
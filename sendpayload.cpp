@@ -0,0 +1,164 @@
+#include "sendpayload.hpp"
+
+#include <cctype>
+#include <cstring>
+
+using namespace smartqq;
+
+namespace {
+
+// As json.hpp dumps a string, less the quotes
+void appendJsonEscaped(const std::string& str, std::string& out)
+{
+    static const char HEX[] = "0123456789abcdef";
+    for (unsigned char c : str) {
+        switch (c) {
+        case '"': out.append("\\\""); break;
+        case '\\': out.append("\\\\"); break;
+        case '\b': out.append("\\b"); break;
+        case '\f': out.append("\\f"); break;
+        case '\n': out.append("\\n"); break;
+        case '\r': out.append("\\r"); break;
+        case '\t': out.append("\\t"); break;
+        default:
+            if (c <= 0x1f) {
+                out.append("\\u00").append(1, HEX[c >> 4]).append(1, HEX[c & 0xf]);
+            } else {
+                out.push_back(c);
+            }
+        }
+    }
+}
+
+std::string jsonEscaped(const std::string& str)
+{
+    std::string out;
+    appendJsonEscaped(str, out);
+    return out;
+}
+
+// As HttpEngine::Escape
+void appendUrlEncoded(const std::string& str, std::string& out)
+{
+    static const char HEX[] = "0123456789ABCDEF";
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            out.push_back(c);
+        } else {
+            out.append(1, '%').append(1, HEX[c >> 4]).append(1, HEX[c & 0xf]);
+        }
+    }
+}
+
+std::string urlEncoded(const std::string& str)
+{
+    std::string out;
+    appendUrlEncoded(str, out);
+    return out;
+}
+
+void appendInteger(int64_t value, std::string& out)
+{
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    do {
+        *--p = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    out.append(p, end - p);
+}
+
+// What a byte of the text becomes, at most 12 characters for a quote or backslash
+struct EncodedByte {
+    unsigned char length;
+    char text[15];
+};
+
+const EncodedByte* textTable()
+{
+    static EncodedByte table[256];
+    static bool built = [] {
+        for (int c = 0; c < 256; c ++) {
+            std::string encoded = urlEncoded(jsonEscaped(jsonEscaped(std::string(1, (char)c))));
+            table[c].length = (unsigned char)encoded.size();
+            std::memcpy(table[c].text, encoded.data(), encoded.size());
+        }
+        return true;
+    }();
+    (void)built;
+    return table;
+}
+
+const char* const TARGET_KEYS[] = {"%22to%22%3A", "%22group_uin%22%3A", "%22did%22%3A"};
+
+const char MSG_ID_KEY[] = "%2C%22msg_id%22%3A";
+
+const char END[] = "%7D";
+
+// 3 bytes of output per byte of text covers everything but quotes,
+// backslashes and control characters
+const size_t EXPANSION = 3;
+
+}
+
+SendPayload::SendPayload()
+{
+    textTable();
+    SetSession(0, "", "");
+}
+
+void SendPayload::SetSession(int64_t clientId, const std::string& psessionid,
+        const std::string& font)
+{
+    // {"content":"[\"text\",[\"font\",\"{...}\"]]","face":573,"clientid":...,
+    //  "psessionid":"...","to":...,"msg_id":...}
+    head_ = "r=";
+    appendUrlEncoded(std::string("{\"content\":\"").append(jsonEscaped("[\"")), head_);
+
+    std::string tail = jsonEscaped(std::string("\",[\"font\",\"").append(jsonEscaped(font))
+            .append("\"]]"));
+    tail.append("\",\"face\":573,\"clientid\":");
+    appendInteger(clientId, tail);
+    tail.append(",\"psessionid\":\"").append(jsonEscaped(psessionid)).append("\",");
+    tail_ = urlEncoded(tail);
+}
+
+void SendPayload::Build(Target target, int64_t id, const std::string& msg, int64_t msgId,
+        std::string& out) const
+{
+    out.reserve(out.size() + head_.size() + msg.size() * EXPANSION + tail_.size() + 64);
+    out.append(head_);
+    AppendText(msg, out);
+    out.append(tail_);
+    out.append(TARGET_KEYS[target]);
+    appendInteger(id, out);
+    out.append(MSG_ID_KEY);
+    appendInteger(msgId, out);
+    out.append(END);
+}
+
+std::string SendPayload::Build(Target target, int64_t id, const std::string& msg,
+        int64_t msgId) const
+{
+    std::string out;
+    Build(target, id, msg, msgId, out);
+    return out;
+}
+
+void SendPayload::AppendText(const std::string& text, std::string& out)
+{
+    const EncodedByte* table = textTable();
+    for (unsigned char c : text) {
+        const EncodedByte& encoded = table[c];
+        if (encoded.length == 1) {
+            out.push_back(encoded.text[0]);
+        } else {
+            out.append(encoded.text, encoded.length);
+        }
+    }
+}
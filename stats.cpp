@@ -0,0 +1,156 @@
+#include "stats.hpp"
+
+using namespace smartqq;
+
+Histogram::Histogram()
+{
+    Reset();
+}
+
+int Histogram::BucketOf(uint64_t value)
+{
+    if (value < (uint64_t)SUB_BUCKETS) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    return (msb - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+        + (int)((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+uint64_t Histogram::UpperBoundOf(int bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    uint64_t lower = (SUB_BUCKETS + sub) << shift;
+    return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void Histogram::Record(uint64_t value)
+{
+    buckets_[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+uint64_t Histogram::Percentile(double p) const
+{
+    uint64_t count = Count();
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100.0 * count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i ++) {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t bound = UpperBoundOf(i);
+            return bound < Max() ? bound : Max();
+        }
+    }
+    return Max();
+}
+
+void Histogram::Reset()
+{
+    for (auto& i : buckets_) {
+        i.store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+EndpointStats::EndpointStats()
+{
+    Reset();
+}
+
+void EndpointStats::RecordTransfer(long status_code, uint64_t micros, uint64_t in, uint64_t out)
+{
+    latency.Record(micros);
+    bytesIn.fetch_add(in, std::memory_order_relaxed);
+    bytesOut.fetch_add(out, std::memory_order_relaxed);
+    int bucket = status_code >= 100 && status_code < 600 ? status_code / 100 : 0;
+    status[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void EndpointStats::RecordAbort()
+{
+    status[0].fetch_add(1, std::memory_order_relaxed);
+}
+
+void EndpointStats::RecordParse(uint64_t micros)
+{
+    parse.Record(micros);
+}
+
+void EndpointStats::RecordRetcode(int retcode)
+{
+    Retcode bucket;
+    switch (retcode) {
+        case 0: bucket = RETCODE_OK; break;
+        case 100: bucket = RETCODE_100; break;
+        case 102: bucket = RETCODE_102; break;
+        case 103: bucket = RETCODE_103; break;
+        case 116: bucket = RETCODE_116; break;
+        case 121: bucket = RETCODE_121; break;
+        default: bucket = RETCODE_OTHER;
+    }
+    retcodes[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void EndpointStats::RecordInvalid()
+{
+    retcodes[RETCODE_INVALID].fetch_add(1, std::memory_order_relaxed);
+}
+
+void EndpointStats::Reset()
+{
+    latency.Reset();
+    parse.Reset();
+    bytesIn.store(0, std::memory_order_relaxed);
+    bytesOut.store(0, std::memory_order_relaxed);
+    for (auto& i : status) {
+        i.store(0, std::memory_order_relaxed);
+    }
+    for (auto& i : retcodes) {
+        i.store(0, std::memory_order_relaxed);
+    }
+}
+
+void EndpointStats::Dump(std::ostream& out) const
+{
+    static const char* const STATUS_NAMES[STATUS_BUCKETS] = {
+        "err", "1xx", "2xx", "3xx", "4xx", "5xx"
+    };
+    static const char* const RETCODE_NAMES[RETCODE_BUCKETS] = {
+        "0", "100", "102", "103", "116", "121", "other", "invalid"
+    };
+
+    out << "n=" << latency.Count()
+        << " latency(us) p50=" << latency.Percentile(50)
+        << " p90=" << latency.Percentile(90)
+        << " p99=" << latency.Percentile(99)
+        << " max=" << latency.Max()
+        << " parse(us) p50=" << parse.Percentile(50)
+        << " p99=" << parse.Percentile(99)
+        << " in=" << bytesIn.load(std::memory_order_relaxed)
+        << " out=" << bytesOut.load(std::memory_order_relaxed);
+    out << " status";
+    for (int i = 0; i < STATUS_BUCKETS; i ++) {
+        uint64_t n = status[i].load(std::memory_order_relaxed);
+        if (n != 0) out << " " << STATUS_NAMES[i] << "=" << n;
+    }
+    out << " retcode";
+    for (int i = 0; i < RETCODE_BUCKETS; i ++) {
+        uint64_t n = retcodes[i].load(std::memory_order_relaxed);
+        if (n != 0) out << " " << RETCODE_NAMES[i] << "=" << n;
+    }
+}
@@ -0,0 +1,142 @@
+/* Decodes the same poll2 response over and over, through the json DOM the
+ * way handlePoll used to, through PollDecoder and through PollDecoder into
+ * pooled arenas, and prints the allocations and nanoseconds each spends per
+ * message.
+ *
+ * poll_bench [messages per response] [rounds] */
+
+#include "polldecode.hpp"
+#include "model.hpp"
+
+#include <json.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+using namespace smartqq;
+
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+    allocations ++;
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+namespace {
+
+// Mostly group messages, like a busy account, see tools/stub_server.cpp
+string makeBody(int messages)
+{
+    static const char FONT[] = "[\"font\",{\"color\":\"000000\",\"name\":\"\\u5B8B\\u4F53\","
+        "\"size\":10,\"style\":[0,0,0]}]";
+    string body = "{\"result\":[";
+    for (int i = 0; i < messages; i ++) {
+        if (i > 0) body.append(",");
+        string common = string(",\"msg_id\":").append(std::to_string(1000 + i))
+            .append(",\"msg_id2\":").append(std::to_string(7000 + i))
+            .append(",\"time\":1457000000,\"to_uin\":2000000}}");
+        if (i % 10 < 6) {
+            body.append("{\"poll_type\":\"group_message\",\"value\":{\"content\":[")
+                .append(FONT).append(",\"an ordinary line of group chatter ").append(std::to_string(i))
+                .append("\"],\"from_uin\":3000001,\"group_code\":3000001,\"msg_type\":4,\"send_uin\":4000")
+                .append(std::to_string(i % 50)).append(common);
+        } else if (i % 10 < 9) {
+            body.append("{\"poll_type\":\"message\",\"value\":{\"content\":[")
+                .append(FONT).append(",\"hi \",[\"face\",14]],\"from_uin\":5000")
+                .append(std::to_string(i % 20)).append(",\"msg_type\":0").append(common);
+        } else {
+            body.append("{\"poll_type\":\"discu_message\",\"value\":{\"content\":[")
+                .append(FONT).append(",\"!Dice 6\"],\"did\":6000001,\"from_uin\":6000001,")
+                .append("\"msg_type\":5,\"send_uin\":7000").append(std::to_string(i % 5)).append(common);
+        }
+    }
+    return body.append("],\"retcode\":0}");
+}
+
+// What handlePoll did before PollDecoder, less the duplicate check
+void decodeDom(const string& body, std::vector<MessageEvent>& events)
+{
+    json jres = json::parse(body);
+    auto result = jres.find("result");
+    if (result == jres.end()) return;
+    auto array = result->get<std::vector<json>>();
+    for (auto message : array) {
+        auto type = message["poll_type"].get<string>();
+        MessageEvent event;
+        if ("message" == type) {
+            event.type = MessageEvent::FRIEND_MESSAGE;
+            event.message = Message(message["value"]);
+        } else if ("group_message" == type) {
+            event.type = MessageEvent::GROUP_MESSAGE;
+            event.groupMessage = GroupMessage(message["value"]);
+        } else if ("discu_message" == type) {
+            event.type = MessageEvent::DISCUSS_MESSAGE;
+            event.discussMessage = DiscussMessage(message["value"]);
+        } else {
+            continue;
+        }
+        events.push_back(std::move(event));
+    }
+}
+
+template <typename Decode>
+void run(const char* name, int messages, int rounds, Decode decode)
+{
+    std::vector<MessageEvent> events;
+    events.reserve(messages);
+    // One round to warm the buffers up
+    decode(events);
+    events.clear();
+
+    size_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i ++) {
+        decode(events);
+        events.clear();
+    }
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    double total = (double)messages * rounds;
+    std::printf("%-6s %8.1f ns/message %6.2f allocations/message\n", name,
+            nanos / total, (allocations - before) / total);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    int messages = argc > 1 ? std::atoi(argv[1]) : 40;
+    int rounds = argc > 2 ? std::atoi(argv[2]) : 2000;
+    if (messages <= 0 || rounds <= 0) {
+        std::fprintf(stderr, "usage: %s [messages per response] [rounds]\n", argv[0]);
+        return 1;
+    }
+    string body = makeBody(messages);
+    std::printf("%d messages, %zu bytes per response, %d rounds\n", messages, body.size(), rounds);
+
+    run("dom", messages, rounds, [&body](std::vector<MessageEvent>& events) {
+        decodeDom(body, events);
+    });
+    PollDecoder decoder;
+    run("sax", messages, rounds, [&body, &decoder](std::vector<MessageEvent>& events) {
+        decoder.Decode(body.data(), body.size(), events);
+    });
+    MessageArenaPool arenas;
+    run("arena", messages, rounds, [&body, &decoder, &arenas](std::vector<MessageEvent>& events) {
+        decoder.Decode(body.data(), body.size(), events, nullptr, arenas.Acquire());
+    });
+    return 0;
+}
@@ -0,0 +1,916 @@
+/* Loopback stand-in for the WebQQ endpoints listed in api.cpp, so the client
+ * can be run and benchmarked without w.qq.com. Point the client at it with
+ * SMARTQQ_BASE_URL=http://127.0.0.1:8080
+ *
+ * A single epoll thread serves keep-alive HTTP/1.1. Messages are injected at
+ * a fixed rate and handed to the outstanding poll2 requests, every response
+ * can be delayed and a share of them replaced by errors. */
+
+#include <json.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+using std::string;
+
+namespace {
+
+struct Options {
+    string bind = "127.0.0.1";
+    int port = 8080;
+    // Injected messages per second, split between friends, groups and discusses
+    double rate = 10;
+    // Most messages in one poll2 response
+    int batch = 20;
+    // Queued messages beyond this drop the oldest ones
+    int backlog = 100000;
+    int friends = 50;
+    int groups = 10;
+    int groupSize = 50;
+    int discusses = 5;
+    int discussSize = 10;
+    // Added to every response, in milliseconds
+    int latency = 0;
+    int jitter = 0;
+    // An idle poll2 is answered after this many milliseconds
+    int pollTimeout = 30000;
+    // Share of api responses turned into http 500 / into the error retcode
+    double httpErrorRate = 0;
+    double retcodeErrorRate = 0;
+    int errorRetcode = 103;
+    // ptqrlogin answers "not scanned" this many times first
+    int scanPolls = 1;
+    int statsInterval = 5;
+    string text = "!Dice 6";
+    unsigned seed = 1;
+};
+
+const int64_t SELF_UIN = 12345678;
+const int64_t FRIEND_BASE = 10000;
+const int64_t GROUP_BASE = 20000;
+const int64_t GROUP_CODE_BASE = 30000;
+const int64_t DISCUSS_BASE = 50000;
+const int64_t GROUP_MEMBER_BASE = 100000000;
+const int64_t DISCUSS_MEMBER_BASE = 200000000;
+const int64_t MEMBER_STRIDE = 100000;
+
+volatile sig_atomic_t stopping = 0;
+
+void onSignal(int)
+{
+    stopping = 1;
+}
+
+int64_t nowMillis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+string percentDecode(const string& str)
+{
+    string ret;
+    ret.reserve(str.length());
+    for (size_t i = 0; i < str.length(); i ++) {
+        if (str[i] == '%' && i + 2 < str.length()) {
+            ret.push_back((char)std::strtol(str.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        } else if (str[i] == '+') {
+            ret.push_back(' ');
+        } else {
+            ret.push_back(str[i]);
+        }
+    }
+    return ret;
+}
+
+std::map<string, string> parseQuery(const string& query)
+{
+    std::map<string, string> params;
+    size_t begin = 0;
+    while (begin < query.length()) {
+        size_t end = query.find('&', begin);
+        if (end == string::npos) end = query.length();
+        size_t eq = query.find('=', begin);
+        if (eq != string::npos && eq < end) {
+            params[percentDecode(query.substr(begin, eq - begin))] =
+                percentDecode(query.substr(eq + 1, end - eq - 1));
+        }
+        begin = end + 1;
+    }
+    return params;
+}
+
+json userInfo(int64_t uin, const string& nick)
+{
+    json j;
+    j["birthday"] = {{"year", 1990}, {"month", 1}, {"day", 1}};
+    j["phone"] = "";
+    j["occupation"] = "";
+    j["college"] = "";
+    j["uin"] = uin;
+    j["blood"] = 0;
+    j["lnick"] = "";
+    j["homepage"] = "";
+    j["vip_info"] = 0;
+    j["city"] = "";
+    j["country"] = "";
+    j["province"] = "";
+    j["personal"] = "";
+    j["shengxiao"] = 1;
+    j["nick"] = nick;
+    j["email"] = "";
+    j["account"] = uin;
+    j["gender"] = "male";
+    j["mobile"] = "";
+    return j;
+}
+
+string okResult(const json& result)
+{
+    json j;
+    j["retcode"] = 0;
+    j["result"] = result;
+    return j.dump();
+}
+
+/* The canned directory: friends, groups, discusses and their info bodies,
+ * rendered once at startup. */
+class Directory {
+public:
+    explicit Directory(const Options& options)
+    {
+        json friends = json::array(), marknames = json::array(), vipinfo = json::array();
+        json info = json::array(), status = json::array();
+        for (int i = 0; i < options.friends; i ++) {
+            int64_t uin = FRIEND_BASE + i;
+            string nick = string("friend") + std::to_string(i);
+            friends.push_back(json::object({{"flag", 0}, {"uin", uin}, {"categories", i % 2}}));
+            marknames.push_back(json::object({{"uin", uin}, {"markname", nick + "-mark"}, {"type", 0}}));
+            vipinfo.push_back(json::object({{"u", uin}, {"is_vip", 0}, {"vip_level", 0}}));
+            info.push_back(json::object({{"face", 0}, {"flag", 0}, {"nick", nick}, {"uin", uin}}));
+            status.push_back(json::object({{"uin", uin}, {"status", "online"}, {"client_type", 1}}));
+            friendInfo_[uin] = okResult(userInfo(uin, nick));
+        }
+        json categories = json::array();
+        categories.push_back(json::object({{"index", 1}, {"sort", 1}, {"name", "stub"}}));
+        friendList_ = okResult({{"friends", friends}, {"marknames", marknames},
+                {"categories", categories}, {"vipinfo", vipinfo}, {"info", info}});
+        friendStatus_ = okResult(status);
+
+        json gnamelist = json::array(), recent = json::array();
+        for (int i = 0; i < options.groups; i ++) {
+            int64_t gid = GROUP_BASE + i, code = GROUP_CODE_BASE + i;
+            string name = string("group") + std::to_string(i);
+            gnamelist.push_back(json::object({{"gid", gid}, {"name", name}, {"flag", 0}, {"code", code}}));
+            recent.push_back(json::object({{"uin", gid}, {"type", 1}}));
+
+            json minfo = json::array(), stats = json::array(), cards = json::array(), vips = json::array();
+            for (int m = 0; m < options.groupSize; m ++) {
+                int64_t uin = GROUP_MEMBER_BASE + i * MEMBER_STRIDE + m;
+                minfo.push_back(json::object({{"nick", string("member") + std::to_string(m)}, {"province", ""},
+                        {"gender", "male"}, {"uin", uin}, {"country", ""}, {"city", ""}}));
+                stats.push_back(json::object({{"uin", uin}, {"client_type", 1}, {"stat", 10}}));
+                cards.push_back(json::object({{"muin", uin}, {"card", string("card") + std::to_string(m)}}));
+                vips.push_back(json::object({{"u", uin}, {"is_vip", 0}, {"vip_level", 0}}));
+            }
+            json ginfo = {{"gid", gid}, {"createtime", 0}, {"memo", ""}, {"name", name},
+                {"owner", GROUP_MEMBER_BASE + i * MEMBER_STRIDE}};
+            groupInfo_[code] = okResult({{"ginfo", ginfo}, {"minfo", minfo}, {"stats", stats},
+                    {"cards", cards}, {"vipinfo", vips}});
+        }
+        groupList_ = okResult({{"gnamelist", gnamelist}, {"gmarklist", json::array()},
+                {"gmasklist", json::array()}});
+
+        json dnamelist = json::array();
+        for (int i = 0; i < options.discusses; i ++) {
+            int64_t did = DISCUSS_BASE + i;
+            string name = string("discuss") + std::to_string(i);
+            dnamelist.push_back(json::object({{"did", did}, {"name", name}}));
+            recent.push_back(json::object({{"uin", did}, {"type", 2}}));
+
+            json memInfo = json::array(), memStatus = json::array();
+            for (int m = 0; m < options.discussSize; m ++) {
+                int64_t uin = DISCUSS_MEMBER_BASE + i * MEMBER_STRIDE + m;
+                memInfo.push_back(json::object({{"uin", uin}, {"nick", string("member") + std::to_string(m)}}));
+                memStatus.push_back(json::object({{"uin", uin}, {"client_type", 1}, {"status", "online"}}));
+            }
+            discussInfo_[did] = okResult({{"info", {{"did", did}, {"discu_name", name}}},
+                    {"mem_info", memInfo}, {"mem_status", memStatus}});
+        }
+        discussList_ = okResult({{"dnamelist", dnamelist}});
+        recentList_ = okResult(recent);
+        selfInfo_ = okResult(userInfo(SELF_UIN, "stub"));
+    }
+
+    const string& friendList() const { return friendList_; }
+    const string& friendStatus() const { return friendStatus_; }
+    const string& groupList() const { return groupList_; }
+    const string& discussList() const { return discussList_; }
+    const string& recentList() const { return recentList_; }
+    const string& selfInfo() const { return selfInfo_; }
+
+    // Empty if there's no such id
+    const string& groupInfo(int64_t code) const { return find(groupInfo_, code); }
+    const string& discussInfo(int64_t did) const { return find(discussInfo_, did); }
+    const string& friendInfo(int64_t uin) const { return find(friendInfo_, uin); }
+
+private:
+    static const string& find(const std::unordered_map<int64_t, string>& bodies, int64_t id)
+    {
+        static const string NONE;
+        auto i = bodies.find(id);
+        return i == bodies.end() ? NONE : i->second;
+    }
+
+    string friendList_;
+    string friendStatus_;
+    string groupList_;
+    string discussList_;
+    string recentList_;
+    string selfInfo_;
+    std::unordered_map<int64_t, string> groupInfo_;
+    std::unordered_map<int64_t, string> discussInfo_;
+    std::unordered_map<int64_t, string> friendInfo_;
+};
+
+struct Counters {
+    uint64_t requests = 0;
+    uint64_t polls = 0;
+    uint64_t idlePolls = 0;
+    uint64_t injected = 0;
+    uint64_t delivered = 0;
+    uint64_t dropped = 0;
+    uint64_t sends = 0;
+    uint64_t httpErrors = 0;
+    uint64_t retcodeErrors = 0;
+};
+
+struct Connection {
+    int fd;
+    // Bumped for every new connection on the same fd, stale timers check it
+    uint64_t generation;
+    string in;
+    string out;
+    size_t written;
+    // A response is owed, further requests wait so answers stay in order
+    bool busy;
+    bool closeAfterWrite;
+};
+
+struct Request {
+    string method;
+    string path;
+    std::map<string, string> query;
+    string host;
+    string body;
+};
+
+class Server {
+public:
+    explicit Server(const Options& options) : options_(options), directory_(options),
+        random_(options.seed), nextGeneration_(1), msgId_(1000)
+    {
+        listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options.port);
+        if (inet_pton(AF_INET, options.bind.c_str(), &addr.sin_addr) != 1
+                || bind(listenFd_, (sockaddr*)&addr, sizeof(addr)) != 0
+                || listen(listenFd_, SOMAXCONN) != 0) {
+            std::perror("listen");
+            std::exit(1);
+        }
+        epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = listenFd_;
+        epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &ev);
+
+        font_ = R"(["font",{"color":"000000","name":"微软雅黑","size":10,"style":[0,0,0]}])";
+        text_ = json(options.text).dump();
+    }
+
+    void Run()
+    {
+        start_ = nowMillis();
+        lastStats_ = start_;
+        std::fprintf(stderr, "Serving on http://%s:%d\n", options_.bind.c_str(), options_.port);
+
+        epoll_event events[64];
+        while (!stopping) {
+            int64_t now = nowMillis();
+            Inject(now);
+            AnswerPolls(now);
+            FireTimers(now);
+            if (options_.statsInterval > 0 && now - lastStats_ >= options_.statsInterval * 1000) {
+                PrintStats(now);
+            }
+
+            int n = epoll_wait(epollFd_, events, 64, NextWakeup(nowMillis()));
+            for (int i = 0; i < n; i ++) {
+                if (events[i].data.fd == listenFd_) {
+                    Accept();
+                } else {
+                    OnEvent(events[i].data.fd, events[i].events);
+                }
+            }
+        }
+        PrintStats(nowMillis());
+    }
+
+private:
+    struct Timer {
+        int64_t due;
+        int fd;
+        uint64_t generation;
+        string response;
+
+        bool operator<(const Timer& other) const {
+            return due > other.due;
+        }
+    };
+
+    struct Waiter {
+        int64_t deadline;
+        int fd;
+        uint64_t generation;
+    };
+
+    void Accept()
+    {
+        while (true) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            Connection& conn = connections_[fd];
+            conn.fd = fd;
+            conn.generation = nextGeneration_ ++;
+            conn.in.clear();
+            conn.out.clear();
+            conn.written = 0;
+            conn.busy = false;
+            conn.closeAfterWrite = false;
+            epoll_event ev;
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = fd;
+            epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev);
+        }
+    }
+
+    void OnEvent(int fd, uint32_t events)
+    {
+        auto i = connections_.find(fd);
+        if (i == connections_.end()) return;
+        Connection& conn = i->second;
+
+        if (events & EPOLLIN) {
+            char buffer[16384];
+            while (true) {
+                ssize_t n = read(fd, buffer, sizeof(buffer));
+                if (n > 0) {
+                    conn.in.append(buffer, n);
+                } else if (n == 0 || errno != EAGAIN) {
+                    Close(conn);
+                    return;
+                } else {
+                    break;
+                }
+            }
+            Process(conn);
+        }
+        if (connections_.count(fd) == 0) return;
+        if (events & EPOLLOUT) {
+            if (Flush(conn)) Process(conn);
+        } else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            Close(conn);
+        }
+    }
+
+    void Close(Connection& conn)
+    {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, conn.fd, nullptr);
+        ::close(conn.fd);
+        connections_.erase(conn.fd);
+    }
+
+    // Parse and answer the buffered requests, one at a time
+    void Process(Connection& connection)
+    {
+        Connection* current = &connection;
+        while (current != nullptr && !current->busy && current->written == current->out.length()) {
+            Connection& conn = *current;
+            size_t end = conn.in.find("\r\n\r\n");
+            if (end == string::npos) return;
+
+            Request request;
+            size_t lineEnd = conn.in.find("\r\n");
+            string line = conn.in.substr(0, lineEnd);
+            size_t sp1 = line.find(' '), sp2 = line.rfind(' ');
+            if (sp1 == string::npos || sp2 <= sp1) {
+                conn.closeAfterWrite = true;
+                conn.busy = true;
+                Send(conn, Response(400, "text/plain", "bad request"));
+                return;
+            }
+            request.method = line.substr(0, sp1);
+            string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+            size_t q = target.find('?');
+            request.path = target.substr(0, q);
+            if (q != string::npos) request.query = parseQuery(target.substr(q + 1));
+
+            size_t contentLength = 0;
+            for (size_t p = lineEnd + 2; p < end; ) {
+                size_t e = conn.in.find("\r\n", p);
+                string header = conn.in.substr(p, e - p);
+                p = e + 2;
+                size_t colon = header.find(':');
+                if (colon == string::npos) continue;
+                string name = header.substr(0, colon);
+                for (auto& c : name) c = (char)std::tolower(c);
+                size_t v = header.find_first_not_of(' ', colon + 1);
+                string value = v == string::npos ? "" : header.substr(v);
+                if (name == "content-length") {
+                    contentLength = std::strtoul(value.c_str(), nullptr, 10);
+                } else if (name == "host") {
+                    request.host = value;
+                } else if (name == "connection" && value == "close") {
+                    conn.closeAfterWrite = true;
+                }
+            }
+            if (conn.in.length() < end + 4 + contentLength) return;
+            request.body = conn.in.substr(end + 4, contentLength);
+            conn.in.erase(0, end + 4 + contentLength);
+
+            conn.busy = true;
+            counters_.requests ++;
+            int fd = conn.fd;
+            uint64_t generation = conn.generation;
+            Handle(conn, request);
+            // The answer may have closed the connection
+            current = Find(fd, generation);
+        }
+    }
+
+    void Handle(Connection& conn, const Request& request)
+    {
+        const string& path = request.path;
+        bool api = path.compare(0, 5, "/api/") == 0 || path.compare(0, 9, "/channel/") == 0;
+        if (api && Chance(options_.httpErrorRate)) {
+            counters_.httpErrors ++;
+            return Reply(conn, Response(500, "text/plain", ""));
+        }
+        if (api && path != "/channel/login2" && Chance(options_.retcodeErrorRate)) {
+            counters_.retcodeErrors ++;
+            return Reply(conn, Json(string("{\"retcode\":").append(std::to_string(options_.errorRetcode))
+                        .append("}")));
+        }
+
+        if (path == "/ptqrshow") {
+            scans_ = 0;
+            return Reply(conn, Response(200, "image/png", "\x89PNG stub",
+                        "Set-Cookie: qrsig=stub; Path=/\r\n"));
+        }
+        if (path == "/ptqrlogin") {
+            if (scans_ ++ < options_.scanPolls) {
+                return Reply(conn, Response(200, "text/html",
+                            "ptuiCB('66','0','','0','二维码未失效。', '');"));
+            }
+            return Reply(conn, Response(200, "text/html", string("ptuiCB('0','0','http://")
+                        .append(request.host).append("/check_sig?pttype=1&uin=12345678','0','登录成功！', 'stub');")));
+        }
+        if (path == "/check_sig") {
+            return Reply(conn, Response(200, "text/html", "",
+                        "Set-Cookie: ptwebqq=0123456789abcdef; Path=/\r\n"
+                        "Set-Cookie: uin=o0012345678; Path=/\r\n"
+                        "Set-Cookie: p_skey=stub; Path=/\r\n"));
+        }
+        if (path == "/report/report" || path == "/w.cgi" || path == "/") {
+            return Reply(conn, Response(200, "text/html", ""));
+        }
+        if (path == "/api/getvfwebqq") {
+            return Reply(conn, Json(okResult({{"vfwebqq", "stubvfwebqq"}})));
+        }
+        if (path == "/channel/login2") {
+            return Reply(conn, Json(okResult({{"uin", SELF_UIN}, {"psessionid", "stubpsessionid"},
+                            {"cip", 0}, {"f", 0}, {"status", "online"}, {"user_state", 0}})));
+        }
+        if (path == "/channel/poll2") {
+            counters_.polls ++;
+            waiters_.push_back({nowMillis() + options_.pollTimeout, conn.fd, conn.generation});
+            return;
+        }
+        if (path == "/channel/send_qun_msg2" || path == "/channel/send_buddy_msg2"
+                || path == "/channel/send_discu_msg2") {
+            json message = ParseBody(request.body);
+            if (message.find("content") == message.end()) {
+                return Reply(conn, Json("{\"retcode\":100}"));
+            }
+            counters_.sends ++;
+            return Reply(conn, Json("{\"errCode\":0,\"msg\":\"send ok\"}"));
+        }
+        if (path == "/api/get_user_friends2") {
+            return Reply(conn, Json(directory_.friendList()));
+        }
+        if (path == "/api/get_group_name_list_mask2") {
+            return Reply(conn, Json(directory_.groupList()));
+        }
+        if (path == "/api/get_discus_list") {
+            return Reply(conn, Json(directory_.discussList()));
+        }
+        if (path == "/api/get_self_info2") {
+            return Reply(conn, Json(directory_.selfInfo()));
+        }
+        if (path == "/channel/get_recent_list2") {
+            return Reply(conn, Json(directory_.recentList()));
+        }
+        if (path == "/channel/get_online_buddies2") {
+            return Reply(conn, Json(directory_.friendStatus()));
+        }
+        if (path == "/api/get_group_info_ext2") {
+            return Reply(conn, Lookup(directory_.groupInfo(QueryId(request, "gcode"))));
+        }
+        if (path == "/channel/get_discu_info") {
+            return Reply(conn, Lookup(directory_.discussInfo(QueryId(request, "did"))));
+        }
+        if (path == "/api/get_friend_info2") {
+            return Reply(conn, Lookup(directory_.friendInfo(QueryId(request, "tuin"))));
+        }
+        if (path == "/api/get_friend_uin2") {
+            int64_t uin = QueryId(request, "tuin");
+            return Reply(conn, Json(okResult({{"account", uin}, {"uin", uin}})));
+        }
+        Reply(conn, Response(404, "text/plain", "not found"));
+    }
+
+    static int64_t QueryId(const Request& request, const char* name)
+    {
+        auto i = request.query.find(name);
+        return i == request.query.end() ? 0 : std::strtoll(i->second.c_str(), nullptr, 10);
+    }
+
+    static json ParseBody(const string& body)
+    {
+        try {
+            if (body.compare(0, 2, "r=") == 0) {
+                return json::parse(percentDecode(body.substr(2)));
+            }
+        } catch (const std::exception&) {
+        }
+        return json::object();
+    }
+
+    string Response(int status, const char* type, const string& body, const char* headers = "")
+    {
+        const char* reason = status == 200 ? "OK" : status == 404 ? "Not Found"
+            : status == 400 ? "Bad Request" : "Internal Server Error";
+        string ret = string("HTTP/1.1 ").append(std::to_string(status)).append(" ").append(reason)
+            .append("\r\nContent-Type: ").append(type)
+            .append("\r\nContent-Length: ").append(std::to_string(body.length()))
+            .append("\r\n").append(headers).append("\r\n");
+        return ret.append(body);
+    }
+
+    string Json(const string& body)
+    {
+        return Response(200, "application/json;charset=utf-8", body);
+    }
+
+    string Lookup(const string& body)
+    {
+        return body.empty() ? Json("{\"retcode\":100}") : Json(body);
+    }
+
+    bool Chance(double p)
+    {
+        return p > 0 && std::uniform_real_distribution<double>(0, 1)(random_) < p;
+    }
+
+    // Delayed by the configured latency, sent right away without one
+    void Reply(Connection& conn, string response)
+    {
+        int delay = options_.latency;
+        if (options_.jitter > 0) {
+            delay += std::uniform_int_distribution<int>(0, options_.jitter)(random_);
+        }
+        if (delay <= 0) {
+            Send(conn, std::move(response));
+            return;
+        }
+        timers_.push({nowMillis() + delay, conn.fd, conn.generation, std::move(response)});
+    }
+
+    // Reply outside of Process, then go on with the requests buffered meanwhile
+    void Answer(Connection& conn, string response)
+    {
+        int fd = conn.fd;
+        uint64_t generation = conn.generation;
+        Reply(conn, std::move(response));
+        Connection* current = Find(fd, generation);
+        if (current != nullptr) {
+            Process(*current);
+        }
+    }
+
+    // Returns false if the connection got closed
+    bool Send(Connection& conn, string response)
+    {
+        conn.out.append(response);
+        conn.busy = false;
+        return Flush(conn);
+    }
+
+    bool Flush(Connection& conn)
+    {
+        while (conn.written < conn.out.length()) {
+            ssize_t n = ::send(conn.fd, conn.out.data() + conn.written,
+                    conn.out.length() - conn.written, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN) break;
+                Close(conn);
+                return false;
+            }
+            conn.written += n;
+        }
+        epoll_event ev;
+        ev.data.fd = conn.fd;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        if (conn.written < conn.out.length()) {
+            ev.events |= EPOLLOUT;
+            epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn.fd, &ev);
+            return true;
+        }
+        epoll_ctl(epollFd_, EPOLL_CTL_MOD, conn.fd, &ev);
+        conn.out.clear();
+        conn.written = 0;
+        if (conn.closeAfterWrite) {
+            Close(conn);
+            return false;
+        }
+        return true;
+    }
+
+    // Answer a request outside of Process, then go on with the buffered ones
+    void Deliver(Connection& conn, string response)
+    {
+        if (Send(conn, std::move(response))) {
+            Process(conn);
+        }
+    }
+
+    Connection* Find(int fd, uint64_t generation)
+    {
+        auto i = connections_.find(fd);
+        if (i == connections_.end() || i->second.generation != generation) return nullptr;
+        return &i->second;
+    }
+
+    void Inject(int64_t now)
+    {
+        if (options_.rate <= 0) return;
+        uint64_t due = (uint64_t)((now - start_) * options_.rate / 1000);
+        int64_t time = (int64_t)std::time(nullptr);
+        while (counters_.injected < due) {
+            counters_.injected ++;
+            messages_.push_back(RenderMessage(time));
+            if (messages_.size() > (size_t)options_.backlog) {
+                messages_.pop_front();
+                counters_.dropped ++;
+            }
+        }
+    }
+
+    string RenderMessage(int64_t time)
+    {
+        int64_t id = msgId_ ++;
+        string content = string("[").append(font_).append(",").append(text_).append("]");
+        string common = string("\"msg_id\":").append(std::to_string(id))
+            .append(",\"msg_id2\":").append(std::to_string(id * 7 + 100000))
+            .append(",\"reply_ip\":176498451,\"time\":").append(std::to_string(time))
+            .append(",\"to_uin\":").append(std::to_string(SELF_UIN));
+
+        // Spread like a busy account: mostly groups, some friends and discusses
+        int kinds[3] = {options_.groups > 0 ? 6 : 0, options_.friends > 0 ? 3 : 0,
+            options_.discusses > 0 ? 1 : 0};
+        int pick = std::discrete_distribution<int>(kinds, kinds + 3)(random_);
+        if (kinds[0] + kinds[1] + kinds[2] == 0) pick = -1;
+
+        string value;
+        if (pick == 0) {
+            int g = std::uniform_int_distribution<int>(0, options_.groups - 1)(random_);
+            int m = std::uniform_int_distribution<int>(0, std::max(options_.groupSize, 1) - 1)(random_);
+            value = string("{\"poll_type\":\"group_message\",\"value\":{\"content\":").append(content)
+                .append(",\"from_uin\":").append(std::to_string(GROUP_BASE + g))
+                .append(",\"group_code\":").append(std::to_string(GROUP_BASE + g))
+                .append(",\"msg_type\":4,\"send_uin\":")
+                .append(std::to_string(GROUP_MEMBER_BASE + g * MEMBER_STRIDE + m));
+        } else if (pick == 2) {
+            int d = std::uniform_int_distribution<int>(0, options_.discusses - 1)(random_);
+            int m = std::uniform_int_distribution<int>(0, std::max(options_.discussSize, 1) - 1)(random_);
+            value = string("{\"poll_type\":\"discu_message\",\"value\":{\"content\":").append(content)
+                .append(",\"did\":").append(std::to_string(DISCUSS_BASE + d))
+                .append(",\"from_uin\":").append(std::to_string(DISCUSS_BASE + d))
+                .append(",\"msg_type\":5,\"send_uin\":")
+                .append(std::to_string(DISCUSS_MEMBER_BASE + d * MEMBER_STRIDE + m));
+        } else {
+            int f = pick == 1 ? std::uniform_int_distribution<int>(0, options_.friends - 1)(random_) : 0;
+            value = string("{\"poll_type\":\"message\",\"value\":{\"content\":").append(content)
+                .append(",\"from_uin\":").append(std::to_string(FRIEND_BASE + f))
+                .append(",\"msg_type\":0");
+        }
+        return value.append(",").append(common).append("}}");
+    }
+
+    void AnswerPolls(int64_t now)
+    {
+        while (!waiters_.empty()) {
+            Waiter waiter = waiters_.front();
+            Connection* conn = Find(waiter.fd, waiter.generation);
+            if (conn == nullptr) {
+                waiters_.pop_front();
+                continue;
+            }
+            if (!messages_.empty()) {
+                waiters_.pop_front();
+                string body = "{\"retcode\":0,\"result\":[";
+                for (int i = 0; i < options_.batch && !messages_.empty(); i ++) {
+                    if (i != 0) body.push_back(',');
+                    body.append(messages_.front());
+                    messages_.pop_front();
+                    counters_.delivered ++;
+                }
+                Answer(*conn, Json(body.append("]}")));
+            } else if (waiter.deadline <= now) {
+                waiters_.pop_front();
+                counters_.idlePolls ++;
+                Answer(*conn, Json("{\"errmsg\":\"error!!!\",\"retcode\":0}"));
+            } else {
+                // Deadlines are in arrival order
+                break;
+            }
+        }
+    }
+
+    void FireTimers(int64_t now)
+    {
+        while (!timers_.empty() && timers_.top().due <= now) {
+            Timer timer = timers_.top();
+            timers_.pop();
+            Connection* conn = Find(timer.fd, timer.generation);
+            if (conn != nullptr) {
+                Deliver(*conn, std::move(timer.response));
+            }
+        }
+    }
+
+    int NextWakeup(int64_t now)
+    {
+        int64_t next = now + 1000;
+        if (options_.rate > 0) {
+            // Next injection, at most every millisecond
+            int64_t at = start_ + (int64_t)((counters_.injected + 1) * 1000 / options_.rate);
+            next = std::min(next, std::max(at, now + 1));
+        }
+        if (!timers_.empty()) next = std::min(next, timers_.top().due);
+        if (!waiters_.empty()) next = std::min(next, waiters_.front().deadline);
+        return (int)std::max<int64_t>(next - now, 0);
+    }
+
+    void PrintStats(int64_t now)
+    {
+        double seconds = (now - lastStats_) / 1000.0;
+        if (seconds <= 0) seconds = 1;
+        std::fprintf(stderr, "requests=%llu polls=%llu idle=%llu injected=%llu delivered=%llu"
+                " dropped=%llu sends=%llu http_err=%llu retcode_err=%llu"
+                " delivered/s=%.1f sends/s=%.1f\n",
+                (unsigned long long)counters_.requests, (unsigned long long)counters_.polls,
+                (unsigned long long)counters_.idlePolls, (unsigned long long)counters_.injected,
+                (unsigned long long)counters_.delivered, (unsigned long long)counters_.dropped,
+                (unsigned long long)counters_.sends, (unsigned long long)counters_.httpErrors,
+                (unsigned long long)counters_.retcodeErrors,
+                (counters_.delivered - last_.delivered) / seconds,
+                (counters_.sends - last_.sends) / seconds);
+        last_ = counters_;
+        lastStats_ = now;
+    }
+
+    const Options& options_;
+    Directory directory_;
+    std::mt19937 random_;
+    int listenFd_;
+    int epollFd_;
+    std::unordered_map<int, Connection> connections_;
+    uint64_t nextGeneration_;
+    std::priority_queue<Timer> timers_;
+    std::deque<Waiter> waiters_;
+    std::deque<string> messages_;
+    string font_;
+    string text_;
+    int64_t msgId_;
+    int scans_ = 0;
+    int64_t start_ = 0;
+    int64_t lastStats_ = 0;
+    Counters counters_;
+    Counters last_;
+};
+
+void usage(const char* name)
+{
+    std::fprintf(stderr,
+            "Usage: %s [option value]...\n"
+            "  --bind ADDR              listen address (127.0.0.1)\n"
+            "  --port N                 listen port (8080)\n"
+            "  --rate N                 injected messages per second (10)\n"
+            "  --batch N                most messages per poll2 response (20)\n"
+            "  --backlog N              queued messages before dropping the oldest (100000)\n"
+            "  --friends N              friends (50)\n"
+            "  --groups N               groups (10)\n"
+            "  --group-size N           members per group (50)\n"
+            "  --discusses N            discusses (5)\n"
+            "  --discuss-size N         members per discuss (10)\n"
+            "  --latency MS             added to every response (0)\n"
+            "  --jitter MS              random extra latency up to MS (0)\n"
+            "  --poll-timeout MS        idle poll2 answer delay (30000)\n"
+            "  --http-error-rate P      share of api responses that are http 500 (0)\n"
+            "  --retcode-error-rate P   share of api responses carrying the error retcode (0)\n"
+            "  --error-retcode N        retcode of those responses (103)\n"
+            "  --scan-polls N           ptqrlogin answers before the scan succeeds (1)\n"
+            "  --stats-interval S       seconds between stats lines, 0 disables (5)\n"
+            "  --text STR               text of every injected message (\"!Dice 6\")\n"
+            "  --seed N                 random seed (1)\n",
+            name);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; i ++) {
+        string name = argv[i];
+        if (name == "--help" || name == "-h" || i + 1 >= argc) {
+            usage(argv[0]);
+            return name == "--help" || name == "-h" ? 0 : 1;
+        }
+        const char* value = argv[++ i];
+        if (name == "--bind") options.bind = value;
+        else if (name == "--port") options.port = std::atoi(value);
+        else if (name == "--rate") options.rate = std::atof(value);
+        else if (name == "--batch") options.batch = std::max(std::atoi(value), 1);
+        else if (name == "--backlog") options.backlog = std::max(std::atoi(value), 1);
+        else if (name == "--friends") options.friends = std::atoi(value);
+        else if (name == "--groups") options.groups = std::atoi(value);
+        else if (name == "--group-size") options.groupSize = std::atoi(value);
+        else if (name == "--discusses") options.discusses = std::atoi(value);
+        else if (name == "--discuss-size") options.discussSize = std::atoi(value);
+        else if (name == "--latency") options.latency = std::atoi(value);
+        else if (name == "--jitter") options.jitter = std::atoi(value);
+        else if (name == "--poll-timeout") options.pollTimeout = std::atoi(value);
+        else if (name == "--http-error-rate") options.httpErrorRate = std::atof(value);
+        else if (name == "--retcode-error-rate") options.retcodeErrorRate = std::atof(value);
+        else if (name == "--error-retcode") options.errorRetcode = std::atoi(value);
+        else if (name == "--scan-polls") options.scanPolls = std::atoi(value);
+        else if (name == "--stats-interval") options.statsInterval = std::atoi(value);
+        else if (name == "--text") options.text = value;
+        else if (name == "--seed") options.seed = (unsigned)std::strtoul(value, nullptr, 10);
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    Server server(options);
+    server.Run();
+    return 0;
+}
@@ -0,0 +1,326 @@
+#include "traffic.hpp"
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+using namespace smartqq;
+
+static const char MAGIC[4] = {'S', 'Q', 'T', 'R'};
+static const uint32_t VERSION = 1;
+
+namespace {
+
+/* Forwards the body to the original sink and keeps a copy for the log */
+class TeeSink : public HttpBodySink {
+public:
+    explicit TeeSink(std::shared_ptr<HttpBodySink> sink) : sink(sink) {}
+
+    void Write(const char* data, size_t length) override {
+        body.append(data, length);
+        sink->Write(data, length);
+    }
+
+    std::shared_ptr<HttpBodySink> sink;
+    std::string body;
+};
+
+template <typename T>
+void putInt(std::string& out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void putString(std::string& out, const std::string& str)
+{
+    putInt<uint32_t>(out, (uint32_t)str.length());
+    out.append(str);
+}
+
+template <typename T>
+T readInt(std::FILE* file)
+{
+    T value;
+    if (std::fread(&value, sizeof(value), 1, file) != 1) {
+        throw std::runtime_error("Truncated traffic log.");
+    }
+    return value;
+}
+
+std::string readString(std::FILE* file)
+{
+    uint32_t length = readInt<uint32_t>(file);
+    std::string str(length, '\0');
+    if (length != 0 && std::fread(&str[0], 1, length, file) != length) {
+        throw std::runtime_error("Truncated traffic log.");
+    }
+    return str;
+}
+
+}
+
+TrafficRecorder::TrafficRecorder(const std::string& path) :
+    begin_(std::chrono::steady_clock::now())
+{
+    file_ = std::fopen(path.c_str(), "wb");
+    if (file_ == nullptr) {
+        throw std::runtime_error(std::string("Failed to open traffic log ").append(path));
+    }
+    std::fwrite(MAGIC, 1, sizeof(MAGIC), file_);
+    std::fwrite(&VERSION, sizeof(VERSION), 1, file_);
+    std::fflush(file_);
+}
+
+TrafficRecorder::~TrafficRecorder()
+{
+    std::fclose(file_);
+}
+
+int64_t TrafficRecorder::Now() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - begin_).count();
+}
+
+HttpCallback TrafficRecorder::Wrap(ApiId id, HttpRequest& request, HttpCallback done)
+{
+    std::shared_ptr<TeeSink> tee;
+    if (request.sink) {
+        tee = std::make_shared<TeeSink>(request.sink);
+        request.sink = tee;
+    }
+    auto record = std::make_shared<TrafficRecord>();
+    record->id = id;
+    record->method = request.method;
+    record->start = Now();
+    record->url = request.url;
+    record->requestBody = request.body;
+
+    return [this, record, tee, done](cpr::Response r) {
+        record->duration = Now() - record->start;
+        record->status = r.status_code;
+        record->error = r.error.code;
+        record->responseBody = tee ? tee->body : r.text;
+        Record(*record);
+        done(std::move(r));
+    };
+}
+
+void TrafficRecorder::Record(const TrafficRecord& record)
+{
+    std::string out;
+    out.reserve(64 + record.url.length() + record.requestBody.length()
+            + record.responseBody.length());
+    putInt<uint16_t>(out, (uint16_t)record.id);
+    putInt<uint8_t>(out, (uint8_t)record.method);
+    putInt<int64_t>(out, record.start);
+    putInt<int64_t>(out, record.duration);
+    putInt<int32_t>(out, (int32_t)record.status);
+    putInt<int32_t>(out, (int32_t)record.error);
+    putString(out, record.url);
+    putString(out, record.requestBody);
+    putString(out, record.responseBody);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::fwrite(out.data(), 1, out.length(), file_);
+    std::fflush(file_);
+}
+
+TrafficReplayer::TrafficReplayer(const std::string& path, Speed speed) :
+    speed_(speed), running_(true), started_(false), cancelled_(false), seq_(0)
+{
+    std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(std::fopen(path.c_str(), "rb"), &std::fclose);
+    if (!file) {
+        throw std::runtime_error(std::string("Failed to open traffic log ").append(path));
+    }
+    char magic[sizeof(MAGIC)];
+    if (std::fread(magic, 1, sizeof(magic), file.get()) != sizeof(magic)
+            || std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+            || readInt<uint32_t>(file.get()) != VERSION) {
+        throw std::runtime_error(std::string("Not a traffic log ").append(path));
+    }
+
+    while (std::fgetc(file.get()) != EOF) {
+        std::fseek(file.get(), -1, SEEK_CUR);
+        TrafficRecord record;
+        uint16_t id = readInt<uint16_t>(file.get());
+        record.method = (HttpRequest::Method)readInt<uint8_t>(file.get());
+        record.start = readInt<int64_t>(file.get());
+        record.duration = readInt<int64_t>(file.get());
+        record.status = readInt<int32_t>(file.get());
+        record.error = (cpr::ErrorCode)readInt<int32_t>(file.get());
+        record.url = readString(file.get());
+        record.requestBody = readString(file.get());
+        record.responseBody = readString(file.get());
+        if (id >= API_COUNT) {
+            throw std::runtime_error("Traffic log has an unknown endpoint.");
+        }
+        record.id = (ApiId)id;
+        records_[id].push_back(std::move(record));
+    }
+
+    thread_ = std::thread(&TrafficReplayer::Loop, this);
+}
+
+TrafficReplayer::~TrafficReplayer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        running_ = false;
+    }
+    cond_.notify_all();
+    thread_.join();
+}
+
+void TrafficReplayer::Submit(ApiId id, HttpRequest request, HttpCallback callback)
+{
+    auto now = std::chrono::steady_clock::now();
+    Pending pending;
+    pending.request = std::move(request);
+    pending.callback = std::move(callback);
+    pending.due = now;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!started_) {
+            started_ = true;
+            begin_ = now;
+        }
+        pending.seq = seq_ ++;
+        cpr::Response& r = pending.response;
+        if (records_[id].empty()) {
+            r.status_code = 0;
+            r.elapsed = 0;
+            r.url = pending.request.url;
+            r.error.code = cpr::ErrorCode::EMPTY_RESPONSE;
+            r.error.message = std::string("Traffic log has no more ").append(apiNameOf(id));
+        } else {
+            TrafficRecord& record = records_[id].front();
+            r.status_code = record.status;
+            r.elapsed = record.duration / 1e6;
+            r.url = record.url;
+            r.text = std::move(record.responseBody);
+            r.error.code = record.error;
+            if (speed_ == RECORDED) {
+                auto at = begin_ + std::chrono::microseconds(record.start + record.duration);
+                if (at > now) pending.due = at;
+            }
+            records_[id].pop_front();
+        }
+        // Cancelled before it got here, the flag was up at Cancel already
+        if (pending.request.cancel && pending.request.cancel->load()) {
+            cancelled_ = true;
+        }
+        pending_.push(std::move(pending));
+    }
+    cond_.notify_all();
+}
+
+size_t TrafficReplayer::GetRemaining()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t remaining = 0;
+    for (auto& i : records_) {
+        remaining += i.size();
+    }
+    return remaining;
+}
+
+void TrafficReplayer::Cancel(const std::shared_ptr<std::atomic<bool>>& flag)
+{
+    flag->store(true);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_ = true;
+    }
+    cond_.notify_all();
+}
+
+void TrafficReplayer::Loop()
+{
+    std::vector<Pending> cancelled;
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        if (cancelled_) {
+            cancelled_ = false;
+            TakeCancelled(cancelled);
+            lock.unlock();
+            for (auto& pending : cancelled) {
+                Abort(pending);
+            }
+            cancelled.clear();
+            lock.lock();
+            continue;
+        }
+        if (pending_.empty()) {
+            if (!running_) return;
+            cond_.wait(lock);
+            continue;
+        }
+        // Whatever is still queued at shutdown is answered right away
+        if (running_ && pending_.top().due > std::chrono::steady_clock::now()) {
+            cond_.wait_until(lock, pending_.top().due);
+            continue;
+        }
+        Pending pending = std::move(const_cast<Pending&>(pending_.top()));
+        pending_.pop();
+        lock.unlock();
+        if (pending.request.cancel && pending.request.cancel->load()) {
+            Abort(pending);
+        } else {
+            Deliver(pending);
+        }
+        lock.lock();
+    }
+}
+
+void TrafficReplayer::TakeCancelled(std::vector<Pending>& cancelled)
+{
+    std::priority_queue<Pending> kept;
+    while (!pending_.empty()) {
+        Pending& pending = const_cast<Pending&>(pending_.top());
+        if (pending.request.cancel && pending.request.cancel->load()) {
+            cancelled.push_back(std::move(pending));
+        } else {
+            kept.push(std::move(pending));
+        }
+        pending_.pop();
+    }
+    pending_.swap(kept);
+}
+
+void TrafficReplayer::Abort(Pending& pending)
+{
+    cpr::Response& r = pending.response;
+    r.status_code = 0;
+    r.elapsed = 0;
+    r.url = pending.request.url;
+    r.text.clear();
+    r.error.code = cpr::ErrorCode::INTERNAL_ERROR;
+    r.error.message = curl_easy_strerror(CURLE_ABORTED_BY_CALLBACK);
+    if (pending.request.stats != nullptr) {
+        pending.request.stats->RecordAbort();
+    }
+    try {
+        pending.callback(std::move(r));
+    } catch (...) {
+    }
+}
+
+void TrafficReplayer::Deliver(Pending& pending)
+{
+    cpr::Response& r = pending.response;
+    if (pending.request.stats != nullptr) {
+        pending.request.stats->RecordTransfer(r.status_code, (uint64_t)(r.elapsed * 1e6),
+                r.text.length(), pending.request.body.length());
+    }
+    if (pending.request.sink) {
+        pending.request.sink->Write(r.text.data(), r.text.length());
+        r.text.clear();
+    }
+    try {
+        pending.callback(std::move(r));
+    } catch (...) {
+        // Same as the engine, a throwing callback must not stop the replay
+    }
+}